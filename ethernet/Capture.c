@@ -0,0 +1,162 @@
+/*
+ * Capture.c
+ *
+ * pcap capture of received and transmitted frames.
+ * Every frame passing through ENC receive and transmit buffers is appended, as pcap record, to the
+ * user-defined area ring (see ENC_UDAWrite). Frame data is copied by ENC DMA, so capture costs
+ * only a few register writes and 16 bytes of record header per frame over SPI.
+ * Captured data should be sent with ENC_CaptureSend; concatenated UDP payloads form a pcap file
+ * (little-endian, Ethernet link type) which could be analysed or replayed offline.
+ * Cost of the receive path for captured traffic is measured on the device by driver statistics
+ * (ENC_GetStats: SPI bytes per frame, frames dropped by ENC, receive latency histogram, see ENC_Service).
+ * Replaying a trace into the receive ring is not possible here - the ring is written only by the ENC MAC -
+ * and needs a host model of the controller (follow-up).
+ * Received frames are captured from ENC_RdUDPFrame, usually called from interrupt routine, so user-defined
+ * area of a captured controller should be accessed from main loop only through ENC_CaptureSend
+ * (or inside ATOMIC_BLOCK).
+ */ 
+
+#include <avr/io.h>
+#include <util/atomic.h>
+#include <stdlib.h>
+#include "ENCx24J600.h"
+#include "Capture.h"
+
+static void ENC_CaptureFrame(ENC_Device*, uint16_t, uint16_t, uint8_t);
+
+
+// Store 32-bit value in little-endian order
+static void PutLE32(uint8_t *Buff, uint32_t Value)
+{
+	Buff[0] = Value & 0xff;
+	Buff[1] = (Value >> 8) & 0xff;
+	Buff[2] = (Value >> 16) & 0xff;
+	Buff[3] = Value >> 24;
+}
+
+
+// Start capture of frames received and transmitted by dev. pcap global header is written to user-defined area
+// ring, followed by a record for every frame. Every controller has its own capture in its user-defined area.
+// Returns ERR if capture is already running, or ENC_ERR_UDA_FULL if there is no room for pcap header.
+// Parameters:
+//			Clock	- function returning time in microseconds, used for record timestamps
+int8_t ENC_CaptureStart(ENC_Device *dev, uint32_t (*Clock)(void))
+{
+	uint8_t Header[24];
+
+	if (dev->Capture != NULL) return ERR;
+
+	// pcap global header: magic, version 2.4, time zone, accuracy, snapshot length, link type (Ethernet)
+	PutLE32(Header, 0xa1b2c3d4);
+	PutLE32(Header + 4, 0x00040002);
+	PutLE32(Header + 8, 0);
+	PutLE32(Header + 12, 0);
+	PutLE32(Header + 16, CAPTURE_SNAPLEN);
+	PutLE32(Header + 20, 1);
+	if (ENC_UDAWrite(dev, Header, 24) != OK) return ENC_ERR_UDA_FULL;
+
+	// MAC address (MAADR1 holds first two bytes, lo byte first)
+	for (uint8_t i = 0; i < 3; i++)
+	{
+		uint16_t w = ENC_RCRU(dev, MAAADR1 - 2 * i);
+		dev->CaptureMAC[2 * i] = w & 0xff;
+		dev->CaptureMAC[2 * i + 1] = w >> 8;
+	}
+
+	dev->CaptureClock = Clock;
+	dev->CaptureDrops = 0;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)	// hook is read by interrupt routine
+	{
+		dev->Capture = ENC_CaptureFrame;
+	}
+
+	return OK;
+}
+
+
+// Stop capture. Captured data stays in user-defined area ring.
+void ENC_CaptureStop(ENC_Device *dev)
+{
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		dev->Capture = NULL;
+	}
+}
+
+
+// Number of frames not captured because user-defined area was full
+uint16_t ENC_CaptureDrops(ENC_Device *dev)
+{
+	uint16_t drops;
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		drops = dev->CaptureDrops;
+	}
+
+	return drops;
+}
+
+
+// Send Len oldest bytes of captured data as UDP datagram (see ENC_UDASendUDPFrame for parameters).
+// Reception of dev is held (ENC_RxHold) while datagram is transmitted, so capture of received frames can't
+// change user-defined area ring and DMA registers meanwhile, and capture hook is suspended, so the drain
+// traffic itself is not captured. Other interrupts, including other controllers, stay enabled.
+int8_t ENC_CaptureSend(ENC_Device *dev, uint8_t *SourceIPAddr, uint8_t *DestIPAddr, uint8_t *DestMACAddr, uint16_t SourcePort, uint16_t DestPort, uint16_t BuffAddr, uint16_t Len)
+{
+	int8_t errorCode;
+
+	ENC_RxHold(dev);
+	void (*hook)(ENC_Device*, uint16_t, uint16_t, uint8_t) = dev->Capture;
+	dev->Capture = NULL;
+	errorCode = ENC_UDASendUDPFrame(dev, SourceIPAddr, DestIPAddr, DestMACAddr, SourcePort, DestPort, BuffAddr, Len);
+	dev->Capture = hook;
+	ENC_RxResume(dev);
+
+	return errorCode;
+}
+
+
+// Append record of frame at Addr in ENC SRAM, Len bytes long, to user-defined area ring. Source MAC address
+// is missing in transmit buffer (it is inserted by ENC), so it is added to the record.
+static void ENC_CaptureRecord(ENC_Device *dev, uint16_t Addr, uint16_t Len, uint8_t Dir)
+{
+	uint8_t Record[16];
+	uint16_t recLen = Dir == ENC_CAPTURE_TX ? Len + 6 : Len;
+
+	if (Len < 6 || ENC_UDAFree(dev) < 16 + recLen)
+	{
+		dev->CaptureDrops++;
+		return;
+	}
+
+	// pcap record header: timestamp (seconds, microseconds), captured and original length
+	uint32_t t = dev->CaptureClock();
+	PutLE32(Record, t / 1000000);
+	PutLE32(Record + 4, t % 1000000);
+	PutLE32(Record + 8, recLen);
+	PutLE32(Record + 12, recLen);
+	ENC_UDAWrite(dev, Record, 16);
+
+	if (Dir == ENC_CAPTURE_TX)
+	{
+		ENC_UDACopy(dev, Addr, 6);				// destination MAC
+		ENC_UDAWrite(dev, dev->CaptureMAC, 6);	// source MAC
+		ENC_UDACopy(dev, Addr + 6, Len - 6);	// Ethertype and payload
+	}
+	else
+	{
+		ENC_UDACopy(dev, Addr, Len);
+	}
+}
+
+
+// Capture hook called by driver. Transmitted frames are captured in main loop and received frames usually
+// in interrupt routine - interrupts are disabled so records and DMA copies of both don't interleave.
+static void ENC_CaptureFrame(ENC_Device *dev, uint16_t Addr, uint16_t Len, uint8_t Dir)
+{
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		ENC_CaptureRecord(dev, Addr, Len, Dir);
+	}
+}
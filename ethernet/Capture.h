@@ -0,0 +1,27 @@
+/*
+ * Capture.h
+ *
+ * pcap capture of received and transmitted frames into ENC user-defined area.
+ */ 
+
+
+#ifndef CAPTURE_H_
+#define CAPTURE_H_
+
+#include "ENCx24J600.h"
+
+#define CAPTURE_SNAPLEN			1518	// maximum captured frame length written to pcap header
+
+// Every record takes 16 bytes of header plus the frame (+6 bytes of source MAC for transmitted frames) in
+// user-defined area, and frames which don't fit are counted by ENC_CaptureDrops. Default ENC_UDA_LEN (0x340)
+// holds only frames up to ~790 bytes - to capture full-size traffic enlarge user-defined area with
+// ENC_SetMemLayout, e.g. ReasmLen = 0x0c00, UdaStart = 0x4400, UdaLen = 0x0f40 for the default layout.
+
+int8_t ENC_CaptureStart(ENC_Device*, uint32_t (*)(void));
+void ENC_CaptureStop(ENC_Device*);
+uint16_t ENC_CaptureDrops(ENC_Device*);
+int8_t ENC_CaptureSend(ENC_Device*, uint8_t*, uint8_t*, uint8_t*, uint16_t, uint16_t, uint16_t, uint16_t);
+
+
+
+#endif /* CAPTURE_H_ */
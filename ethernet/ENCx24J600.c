@@ -22,138 +22,321 @@
 
 #include <avr/io.h>
 #include <util/delay.h>
+#include <util/atomic.h>
 #include <stdlib.h>
+#include <string.h>
 #include "ENCx24J600.h"
-#include "main.h"
 
-static int16_t NextPacketPointer;	// pointer to the next packet in receive buffer
+// SPI access through device handle
+// wait for assertion of IF (transmit/receive completed) - byte is counted while it is shifted out
+#define ENC_SPI_WAIT(dev)	do { (dev)->Stats.SpiBytes++; while(!((dev)->Spi->STATUS & SPI_IF_bm)); } while (0)
+#define ENC_CS_ON(dev)		(dev)->CsPort->OUTCLR = (dev)->CsPin_bm		// assert CS
+#define ENC_CS_OFF(dev)		(dev)->CsPort->OUTSET = (dev)->CsPin_bm		// deassert CS
+
+// Default SRAM partitioning
+static const ENC_MemLayout DefaultLayout =
+{
+	ENC_RX_START,
+	ENC_TXRING_START, ENC_TXRING_SLOTS, ENC_TXRING_SLOT_SIZE,
+	ENC_REASM_START, ENC_REASM_MAX_LEN,
+	ENC_UDA_START, ENC_UDA_LEN
+};
+
+static int8_t ENC_ReasmFragment(ENC_Device*, uint8_t*, uint16_t, uint16_t*, uint16_t*, uint16_t*);
 
 
-// Initialize ENCx24J600
-// Assumes SPI interface on Port D, interrupt line connected to Pin 0. SPI should be initialized
-// before calling ENC_Init (function SPIC_Init in SPI.c)
-int8_t ENC_Init()
+// Initialize ENCx24J600 and its device handle
+// SPI peripheral and CS pin should be initialized before calling ENC_Init (function SPID_Init in main.c).
+// Every controller needs its own ENC_Device, all other functions take it as first parameter.
+// Returns ERR if controller doesn't respond after reset, or error code of ENC_SetMemLayout if default SRAM
+// layout is rejected (reception and interrupts are not enabled in both cases).
+// Parameters:
+//			Spi			- SPI peripheral connected to ENC (e.g. &SPID)
+//			CsPort		- port with CS pin
+//			CsPin_bm	- CS pin bit mask
+//			IntPort		- port with ENC INT line (INT0 interrupt of this port is enabled, medium level)
+//			IntPin		- INT pin number (0..7)
+int8_t ENC_Init(ENC_Device *dev, SPI_t *Spi, PORT_t *CsPort, uint8_t CsPin_bm, PORT_t *IntPort, uint8_t IntPin)
 {
+	memset(dev, 0, sizeof(ENC_Device));
+	dev->Spi = Spi;
+	dev->CsPort = CsPort;
+	dev->CsPin_bm = CsPin_bm;
+	dev->IntPort = IntPort;
+	dev->IntPin = IntPin;
+
 	// Wait for ENC SPI interface to initialize
 	do
 	{
-		ENC_WCRU(EUDAST,0x1234);
-	} while (ENC_RCRU(EUDAST) != 0x1234);
+		ENC_WCRU(dev, EUDAST,0x1234);
+	} while (ENC_RCRU(dev, EUDAST) != 0x1234);
 	
 	// Wait for stable clock
-	while (!(ENC_RCRU(ESTAT) & ENC_ESTAT_CLKRDY_bm));
+	while (!(ENC_RCRU(dev, ESTAT) & ENC_ESTAT_CLKRDY_bm));
 
 	// Reset
-	ENC_SETETHRST();
+	ENC_SETETHRST(dev);
 	_delay_us(50);
 
 	// Check that EUDAST returned to default value
-	if (ENC_RCRU(EUDAST) != 0x0000) return ERR;
+	if (ENC_RCRU(dev, EUDAST) != 0x0000) return ERR;
 	
 	// wait at least 256 us for PHY initialization
 	_delay_us(500);
 
 
 	// Enable Ethernet, LED stretching, automatic MAC Address transmission, transmit and receive logic
-	ENC_WCRU(ECON2,0xe000);
+	ENC_WCRU(dev, ECON2,0xe000);
 
-	// Initialize 'NextPacketPointer' to ERXST
-	NextPacketPointer = ENC_RCRU(ERXST);
+	// Partition SRAM (receive ring, TX slots, reassembly arena, user-defined area) and initialize 'NextPacketPointer' to ERXST
+	int8_t errorCode = ENC_SetMemLayout(dev, &DefaultLayout);
+	if (errorCode != OK) return errorCode;
 
 	// Disable reception of broadcast (ff-ff-ff-ff-ff-ff) frames - only frames having correct MAC address will be accepted
-	ENC_BFCU(ERXFCON, ENC_ERXFCON_BCEN_bm);
+	ENC_BFCU(dev, ERXFCON, ENC_ERXFCON_BCEN_bm);
 
 	// Enable reception
-	ENC_BFSU(ECON1, ENC_ECON1_RXEN_bm);
+	ENC_BFSU(dev, ECON1, ENC_ECON1_RXEN_bm);
 
-	// Interrupt control - PORT C, Pin 0
-	PORTD.PIN0CTRL = PORT_OPC_PULLUP_gc | PORT_ISC_FALLING_gc;	// falling edge
-	PORTD.INT0MASK = PIN0_bm;
-	PORTD.INTCTRL = PORT_INT0LVL_MED_gc;						// medium priority
+	// Interrupt control - INT0 of IntPort (could be shared by several controllers on the same port)
+	(&IntPort->PIN0CTRL)[IntPin] = PORT_OPC_PULLUP_gc | PORT_ISC_FALLING_gc;	// falling edge
+	IntPort->INT0MASK |= 1 << IntPin;
+	IntPort->INTCTRL = (IntPort->INTCTRL & ~PORT_INT0LVL_gm) | PORT_INT0LVL_MED_gc;	// medium priority
 
 	PMIC.CTRL |= PMIC_MEDLVLEN_bm;								// enable medium level interrupts
 
 	// Enable ENC interrupts
-	ENC_SETEIE();
+	ENC_SETEIE(dev);
+
+	return OK;
+}
+
+
+// Partition ENC SRAM into receive ring, TX slot pool, reassembly arena and user-defined area.
+// Layout is checked first (regions inside SRAM, below receive ring and not overlapping each other),
+// ENC_ERR_LAYOUT is returned and nothing is changed if it is not valid.
+// Reception is stopped while ERXST is changed - packets waiting in receive buffer are discarded, retained
+// TX frames and incomplete reassembly are dropped. Reception is re-enabled if it was enabled before.
+int8_t ENC_SetMemLayout(ENC_Device *dev, const ENC_MemLayout *NewLayout)
+{
+	uint16_t start[3];
+	uint32_t len[3];
+
+	// receive ring should hold at least one maximum length frame with its next packet pointer and RSV
+	if ((NewLayout->RxStart & 1) || NewLayout->RxStart > ENC_SRAM_END + 1 - ENC_RX_MIN_LEN) return ENC_ERR_LAYOUT;
+	if (NewLayout->TxSlots == 0 || NewLayout->TxSlots > ENC_TXRING_SLOTS || (NewLayout->TxSlots & (NewLayout->TxSlots - 1))) return ENC_ERR_LAYOUT;
+	if (NewLayout->ReasmLen > ENC_REASM_MAX_LEN) return ENC_ERR_LAYOUT;
+
+	start[0] = NewLayout->TxStart;		len[0] = (uint32_t)NewLayout->TxSlots * NewLayout->TxSlotSize;
+	start[1] = NewLayout->ReasmStart;	len[1] = NewLayout->ReasmLen;
+	start[2] = NewLayout->UdaStart;		len[2] = NewLayout->UdaLen;
+	for (uint8_t i = 0; i < 3; i++)
+	{
+		// region must end below receive ring
+		if ((uint32_t)start[i] + len[i] > NewLayout->RxStart) return ENC_ERR_LAYOUT;
+		for (uint8_t j = i + 1; j < 3; j++)
+		{
+			if (len[i] > 0 && len[j] > 0 && start[i] < start[j] + len[j] && start[j] < start[i] + len[i]) return ENC_ERR_LAYOUT;
+		}
+	}
+
+	// stop reception and wait for completion of ongoing reception
+	uint16_t rxEnabled = ENC_RCRU(dev, ECON1) & ENC_ECON1_RXEN_bm;
+	ENC_BFCU(dev, ECON1, ENC_ECON1_RXEN_bm);
+	while (ENC_RCRU(dev, ESTAT) & ENC_ESTAT_RXBUSY_bm);
+
+	// discard received packets
+	while (ENC_RCRU(dev, ESTAT) & ENC_ESTAT_PKTCNT_bm)
+	{
+		ENC_BFSU(dev, ECON1, ENC_ECON1_PKTDEC_bm);
+	}
+
+	// receive ring
+	dev->Layout = *NewLayout;
+	ENC_WCRU(dev, ERXST, dev->Layout.RxStart);
+	ENC_WCRU(dev, ERXTAIL, ENC_SRAM_END - 1);
+	dev->NextPacketPointer = dev->Layout.RxStart;
+
+	// user-defined area (placed outside SRAM to disable it)
+	if (dev->Layout.UdaLen > 0)
+	{
+		ENC_WCRU(dev, EUDAST, dev->Layout.UdaStart);
+		ENC_WCRU(dev, EUDAND, dev->Layout.UdaStart + dev->Layout.UdaLen - 1);
+	}
+	else
+	{
+		ENC_WCRU(dev, EUDAST, ENC_SRAM_END + 1);
+		ENC_WCRU(dev, EUDAND, ENC_SRAM_END + 2);
+	}
+
+	// retransmission ring and reassembly arena start empty
+	dev->TxRingBase = dev->TxRingNext;
+	dev->TxRingLastAddr = 0xffff;
+	dev->ReasmReady = 0;
+	dev->ReasmTimer = 0;
+	ENC_UDAReset(dev);
+
+	if (rxEnabled) ENC_BFSU(dev, ECON1, ENC_ECON1_RXEN_bm);
 
 	return OK;
 }
 
 
+// Get current SRAM partitioning
+void ENC_GetMemLayout(ENC_Device *dev, ENC_MemLayout *CurLayout)
+{
+	*CurLayout = dev->Layout;
+}
+
+
+// Copy driver statistics. Interrupts are disabled while copying, so counters updated by interrupt routine
+// are consistent with each other.
+void ENC_GetStats(ENC_Device *dev, ENC_Stats *Stats)
+{
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		*Stats = dev->Stats;
+	}
+}
+
+
+// Receive latency (see ENC_Stats.RxLatency) not exceeded by Percent % of frames, in microseconds. Result is
+// the upper bound of the histogram bin, i.e. rounded up to power of 2. Returns 0 if no latency was recorded
+// and 0xffffffff if the percentile falls into the last bin.
+uint32_t ENC_RxLatencyPercentile(ENC_Device *dev, uint8_t Percent)
+{
+	uint16_t hist[ENC_LATENCY_BINS];
+	uint32_t total = 0, sum = 0;
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		memcpy(hist, dev->Stats.RxLatency, sizeof(hist));
+	}
+
+	for (uint8_t i = 0; i < ENC_LATENCY_BINS; i++)
+	{
+		total += hist[i];
+	}
+	if (total == 0) return 0;
+
+	// rank of the frame at the percentile (at least the first one)
+	uint32_t rank = (total * Percent + 99) / 100;
+	if (rank == 0) rank = 1;
+
+	for (uint8_t i = 0; i < ENC_LATENCY_BINS - 1; i++)
+	{
+		sum += hist[i];
+		if (sum >= rank) return 2UL << i;
+	}
+
+	return 0xffffffff;
+}
+
+
+// Add frame to receive latency histogram
+static void ENC_RecordLatency(ENC_Device *dev, uint32_t Latency)
+{
+	uint8_t bin = 0;
+
+	while (Latency > 1 && bin < ENC_LATENCY_BINS - 1)
+	{
+		Latency >>= 1;
+		bin++;
+	}
+	if (dev->Stats.RxLatency[bin] != 0xffff) dev->Stats.RxLatency[bin]++;
+}
+
+
 // ENCx24J600 System reset
-void ENC_SETETHRST()
+void ENC_SETETHRST(ENC_Device *dev)
 {
 	uint8_t dummy;
 
-	SPI_CS_ON;
+	ENC_CS_ON(dev);
 
-	SPIC.DATA = 0xca;	// op code
-	SPI_WAIT;
-	dummy = SPIC.DATA;	// to clear Interrupt Flag
+	dev->Spi->DATA = 0xca;	// op code
+	ENC_SPI_WAIT(dev);
+	dummy = dev->Spi->DATA;	// to clear Interrupt Flag
 
-	SPI_CS_OFF;
+	ENC_CS_OFF(dev);
 }
 
 
 // Enables ENCx24J600 interrupt system and packet received interrupt
-void ENC_SETEIE()
+void ENC_SETEIE(ENC_Device *dev)
 {
-	ENC_WCRU(EIE, 0x8040);		// set INTIE and PKTIE (packet received interrupt enable)
+	ENC_WCRU(dev, EIE, 0x8040);		// set INTIE and PKTIE (packet received interrupt enable)
 }
 
 // Disables ENCx24J600 interrupt system
-void ENC_CLREIE()
+void ENC_CLREIE(ENC_Device *dev)
 {
 	uint8_t dummy;
 
-	SPI_CS_ON;
+	ENC_CS_ON(dev);
 
-	SPIC.DATA = 0xee;	// op code
-	SPI_WAIT;
-	dummy = SPIC.DATA;
+	dev->Spi->DATA = 0xee;	// op code
+	ENC_SPI_WAIT(dev);
+	dummy = dev->Spi->DATA;
 
-	SPI_CS_OFF;
+	ENC_CS_OFF(dev);
 }
 
 // Configure and start DMA checksum
-void ENC_DMACKSUM()
+void ENC_DMACKSUM(ENC_Device *dev)
 {
 	uint8_t dummy;
 
-	SPI_CS_ON;
+	ENC_CS_ON(dev);
 
-	SPIC.DATA = 0xd8;	// op code
-	SPI_WAIT;
-	dummy = SPIC.DATA;
+	dev->Spi->DATA = 0xd8;	// op code
+	ENC_SPI_WAIT(dev);
+	dummy = dev->Spi->DATA;
 
-	SPI_CS_OFF;
+	ENC_CS_OFF(dev);
+}
+
+
+// Configure and start DMA copy (EDMAST => EDMADST, EDMALEN bytes). Checksum of copied data
+// is calculated at the same time.
+void ENC_DMACOPY(ENC_Device *dev)
+{
+	uint8_t dummy;
+
+	ENC_CS_ON(dev);
+
+	dev->Spi->DATA = 0xdc;	// op code
+	ENC_SPI_WAIT(dev);
+	dummy = dev->Spi->DATA;
+
+	ENC_CS_OFF(dev);
 }
 
 
 // Read Control Register Unbanked
 // Fetches content of 16-bit ENCx24J600 register. Common registers are defined
 // in ENCx24J600.h
-uint16_t ENC_RCRU(uint8_t addr)
+uint16_t ENC_RCRU(ENC_Device *dev, uint8_t addr)
 {
 	uint8_t dummy, hi, lo;
 
-	SPI_CS_ON;
+	ENC_CS_ON(dev);
 
-	SPIC.DATA = 0x20;	// op code
-	SPI_WAIT;
+	dev->Spi->DATA = 0x20;	// op code
+	ENC_SPI_WAIT(dev);
 
-	SPIC.DATA = addr;	// register address
-	SPI_WAIT;
+	dev->Spi->DATA = addr;	// register address
+	ENC_SPI_WAIT(dev);
 	
-	SPIC.DATA = DUMMY;
-	SPI_WAIT;
-	lo = SPIC.DATA;
+	dev->Spi->DATA = DUMMY;
+	ENC_SPI_WAIT(dev);
+	lo = dev->Spi->DATA;
 	
-	SPIC.DATA = DUMMY;
-	SPI_WAIT;
-	hi = SPIC.DATA;
+	dev->Spi->DATA = DUMMY;
+	ENC_SPI_WAIT(dev);
+	hi = dev->Spi->DATA;
 	
-	SPI_CS_OFF;
+	ENC_CS_OFF(dev);
 	
 	return lo + (hi<<8);
 }
@@ -162,118 +345,205 @@ uint16_t ENC_RCRU(uint8_t addr)
 // Write Control Register Unbanked
 // Writes to 16-bit ENCx24J600 register. Common registers are defined
 // in ENCx24J600.h
-void ENC_WCRU(uint8_t addr, uint16_t data)
+void ENC_WCRU(ENC_Device *dev, uint8_t addr, uint16_t data)
 {
 	uint8_t hi = (data>>8);
 	uint8_t lo = data - (hi<<8);
 	uint8_t dummy;
 
-	SPI_CS_ON;
+	ENC_CS_ON(dev);
 
-	SPIC.DATA = 0x22;	// op code
-	SPI_WAIT;
+	dev->Spi->DATA = 0x22;	// op code
+	ENC_SPI_WAIT(dev);
 
-	SPIC.DATA = addr;	// register address
-	SPI_WAIT;
+	dev->Spi->DATA = addr;	// register address
+	ENC_SPI_WAIT(dev);
 
-	SPIC.DATA = lo;
-	SPI_WAIT;
+	dev->Spi->DATA = lo;
+	ENC_SPI_WAIT(dev);
 
-	SPIC.DATA = hi;
-	SPI_WAIT;
-	dummy = SPIC.DATA;	// to clear Interrupt Flag
+	dev->Spi->DATA = hi;
+	ENC_SPI_WAIT(dev);
+	dummy = dev->Spi->DATA;	// to clear Interrupt Flag
 
-	SPI_CS_OFF;
+	ENC_CS_OFF(dev);
 }
 
 
 // Bit Field Set, Unbanked
-void ENC_BFSU(uint8_t addr, uint16_t mask)
+void ENC_BFSU(ENC_Device *dev, uint8_t addr, uint16_t mask)
 {
 	uint8_t hi = (mask>>8);
 	uint8_t lo = mask - (hi<<8);
 	uint8_t dummy;
 
-	SPI_CS_ON;
+	ENC_CS_ON(dev);
 
-	SPIC.DATA = 0x24;	// op code
-	SPI_WAIT;
+	dev->Spi->DATA = 0x24;	// op code
+	ENC_SPI_WAIT(dev);
 
-	SPIC.DATA = addr;	// register address
-	SPI_WAIT;
+	dev->Spi->DATA = addr;	// register address
+	ENC_SPI_WAIT(dev);
 
-	SPIC.DATA = lo;
-	SPI_WAIT;
+	dev->Spi->DATA = lo;
+	ENC_SPI_WAIT(dev);
 
-	SPIC.DATA = hi;
-	SPI_WAIT;
-	dummy = SPIC.DATA;	// to clear Interrupt Flag
+	dev->Spi->DATA = hi;
+	ENC_SPI_WAIT(dev);
+	dummy = dev->Spi->DATA;	// to clear Interrupt Flag
 
-	SPI_CS_OFF;
+	ENC_CS_OFF(dev);
 }
 
 
 // Bit Field Clear, Unbanked
-void ENC_BFCU(uint8_t addr, uint16_t mask)
+void ENC_BFCU(ENC_Device *dev, uint8_t addr, uint16_t mask)
 {
 	uint8_t hi = (mask>>8);
 	uint8_t lo = mask - (hi<<8);
 	uint8_t dummy;
 
-	SPI_CS_ON;
+	ENC_CS_ON(dev);
 
-	SPIC.DATA = 0x26;	// op code
-	SPI_WAIT;
+	dev->Spi->DATA = 0x26;	// op code
+	ENC_SPI_WAIT(dev);
 
-	SPIC.DATA = addr;	// register address
-	SPI_WAIT;
+	dev->Spi->DATA = addr;	// register address
+	ENC_SPI_WAIT(dev);
 
-	SPIC.DATA = lo;
-	SPI_WAIT;
+	dev->Spi->DATA = lo;
+	ENC_SPI_WAIT(dev);
 
-	SPIC.DATA = hi;
-	SPI_WAIT;
-	dummy = SPIC.DATA;	// to clear Interrupt Flag
+	dev->Spi->DATA = hi;
+	ENC_SPI_WAIT(dev);
+	dummy = dev->Spi->DATA;	// to clear Interrupt Flag
 
-	SPI_CS_OFF;
+	ENC_CS_OFF(dev);
 }
 
 
 // Write General Purpose Buffer Write Pointer (EGPWRPT)
 // Area in general purpose buffer is used to prepare packets for transmission.
-void ENC_WGPWRPT(uint16_t BuffAddr)
+void ENC_WGPWRPT(ENC_Device *dev, uint16_t BuffAddr)
+{
+	uint8_t hi = (BuffAddr>>8);
+	uint8_t lo = BuffAddr - (hi<<8);
+	uint8_t dummy;
+
+	ENC_CS_ON(dev);
+
+	dev->Spi->DATA = 0x6c;	// op code
+	ENC_SPI_WAIT(dev);
+
+	dev->Spi->DATA = lo;
+	ENC_SPI_WAIT(dev);
+
+	dev->Spi->DATA = hi;
+	ENC_SPI_WAIT(dev);
+	dummy = dev->Spi->DATA;	// to clear Interrupt Flag
+
+	ENC_CS_OFF(dev);
+}
+
+// Write General Purpose Buffer Read Pointer (EGPRDPT)
+void ENC_WGPRDPT(ENC_Device *dev, uint16_t BuffAddr)
+{
+	uint8_t hi = (BuffAddr>>8);
+	uint8_t lo = BuffAddr - (hi<<8);
+	uint8_t dummy;
+
+	ENC_CS_ON(dev);
+
+	dev->Spi->DATA = 0x60;	// op code
+	ENC_SPI_WAIT(dev);
+
+	dev->Spi->DATA = lo;
+	ENC_SPI_WAIT(dev);
+
+	dev->Spi->DATA = hi;
+	ENC_SPI_WAIT(dev);
+	dummy = dev->Spi->DATA;	// to clear Interrupt Flag
+
+	ENC_CS_OFF(dev);
+}
+
+
+// Read Len bytes from general purpose buffer, starting at BuffAddr
+void ENC_RdGPBuff(ENC_Device *dev, uint16_t BuffAddr, uint8_t *Data, uint16_t Len)
+{
+	ENC_WGPRDPT(dev, BuffAddr);
+
+	ENC_CS_ON(dev);
+	dev->Spi->DATA = RGPDATA;	// command for sequential reading from general purpose buffer
+	ENC_SPI_WAIT(dev);
+	for (uint16_t i = 0; i < Len; i++)
+	{
+		dev->Spi->DATA = DUMMY;
+		ENC_SPI_WAIT(dev);
+		Data[i] = dev->Spi->DATA;
+	}
+	ENC_CS_OFF(dev);
+}
+
+
+// Write User-Defined Area Read Pointer (EUDARDPT)
+void ENC_WUDARDPT(ENC_Device *dev, uint16_t BuffAddr)
+{
+	uint8_t hi = (BuffAddr>>8);
+	uint8_t lo = BuffAddr - (hi<<8);
+	uint8_t dummy;
+
+	ENC_CS_ON(dev);
+
+	dev->Spi->DATA = 0x68;	// op code
+	ENC_SPI_WAIT(dev);
+
+	dev->Spi->DATA = lo;
+	ENC_SPI_WAIT(dev);
+
+	dev->Spi->DATA = hi;
+	ENC_SPI_WAIT(dev);
+	dummy = dev->Spi->DATA;	// to clear Interrupt Flag
+
+	ENC_CS_OFF(dev);
+}
+
+
+// Write User-Defined Area Write Pointer (EUDAWRPT)
+void ENC_WUDAWRPT(ENC_Device *dev, uint16_t BuffAddr)
 {
 	uint8_t hi = (BuffAddr>>8);
 	uint8_t lo = BuffAddr - (hi<<8);
 	uint8_t dummy;
 
-	SPI_CS_ON;
+	ENC_CS_ON(dev);
 
-	SPIC.DATA = 0x6c;	// op code
-	SPI_WAIT;
+	dev->Spi->DATA = 0x74;	// op code
+	ENC_SPI_WAIT(dev);
 
-	SPIC.DATA = lo;
-	SPI_WAIT;
+	dev->Spi->DATA = lo;
+	ENC_SPI_WAIT(dev);
 
-	SPIC.DATA = hi;
-	SPI_WAIT;
-	dummy = SPIC.DATA;	// to clear Interrupt Flag
+	dev->Spi->DATA = hi;
+	ENC_SPI_WAIT(dev);
+	dummy = dev->Spi->DATA;	// to clear Interrupt Flag
 
-	SPI_CS_OFF;
+	ENC_CS_OFF(dev);
 }
 
+
 // Request Packet Transmission
-void ENC_SETTXRTS()
+void ENC_SETTXRTS(ENC_Device *dev)
 {
 	uint8_t dummy;
 
-	SPI_CS_ON;
+	ENC_CS_ON(dev);
 
-	SPIC.DATA = 0xd4;	// op code
-	SPI_WAIT;
-	dummy = SPIC.DATA;	// to clear Interrupt Flag
+	dev->Spi->DATA = 0xd4;	// op code
+	ENC_SPI_WAIT(dev);
+	dummy = dev->Spi->DATA;	// to clear Interrupt Flag
 
-	SPI_CS_OFF;
+	ENC_CS_OFF(dev);
 }
 
 
@@ -289,19 +559,25 @@ void ENC_SETTXRTS()
 //			BuffAddr					- Start address in general purpose buffer.
 //			Len							- Length of Data field of UDP datagram. Total length of Ethernet frame to be transmitted is calculated inside function.
 //			Data						- uint8_t array containing data. Maximum length is 1472 bytes (to satisfy max Ethernet frame payload limit of 1500 bytes).
-//										  Minimum length is 0 bytes.
-void ENC_SendUDPFrame(uint8_t *SourceIPAddr, uint8_t *DestIPAddr, uint8_t *DestMACAddr, uint16_t SourcePort, uint16_t DestPort, uint16_t BuffAddr, uint16_t Len, uint8_t *data)
+//										  Minimum length is 0 bytes. If NULL, data is already in general purpose buffer
+//										  at BuffAddr + UDP_HEADER_LEN (e.g. copied by DMA) and only header is written.
+void ENC_SendUDPFrame(ENC_Device *dev, uint8_t *SourceIPAddr, uint8_t *DestIPAddr, uint8_t *DestMACAddr, uint16_t SourcePort, uint16_t DestPort, uint16_t BuffAddr, uint16_t Len, uint8_t *data)
+{
+	ENC_WrUDPFrame(dev, SourceIPAddr, DestIPAddr, DestMACAddr, SourcePort, DestPort, BuffAddr, Len, data);
+	ENC_TxFrame(dev, BuffAddr, UDP_HEADER_LEN + Len);
+}
+
+
+// Construct UDP frame in general purpose buffer without transmitting it. Frame could be transmitted later
+// with ENC_TxFrame (e.g. by transmit scheduler). Parameters are the same as for ENC_SendUDPFrame.
+void ENC_WrUDPFrame(ENC_Device *dev, uint8_t *SourceIPAddr, uint8_t *DestIPAddr, uint8_t *DestMACAddr, uint16_t SourcePort, uint16_t DestPort, uint16_t BuffAddr, uint16_t Len, uint8_t *data)
 {
 	uint8_t dummy;
 	uint8_t Header[UDP_HEADER_LEN];
 	uint8_t UDPPseudoHeader[20];	// pseudo header for checksum calculation
 
-	// set General Purpose Buffer Write Pointer (EGPWRPT) and start address (ETXST).
-	ENC_WGPWRPT(BuffAddr);
-	ENC_WCRU(ETXST, BuffAddr);
-
-	// len => ETXLEN (total number of bytes in Tx buffer: Ethernet frame header (8) + IPv4 header (20) + UDP header (8) + UDP data (Len) )
-	ENC_WCRU(ETXLEN, UDP_HEADER_LEN + Len);
+	// set General Purpose Buffer Write Pointer (EGPWRPT)
+	ENC_WGPWRPT(dev, BuffAddr);
 
 	// Ethernet header
 	// destination MAC
@@ -379,59 +655,168 @@ void ENC_SendUDPFrame(uint8_t *SourceIPAddr, uint8_t *DestIPAddr, uint8_t *DestM
 
 	
 	// write data to buffer (send op code followed by n data bytes (CS asserted)
-	SPI_CS_ON;
-	SPIC.DATA = WGPDATA;
-	SPI_WAIT;
+	ENC_CS_ON(dev);
+	dev->Spi->DATA = WGPDATA;
+	ENC_SPI_WAIT(dev);
 	// Header
 	for (uint8_t i = 0; i < UDP_HEADER_LEN; i++)
 	{
-		SPIC.DATA = Header[i];
-		SPI_WAIT;
+		dev->Spi->DATA = Header[i];
+		ENC_SPI_WAIT(dev);
 	}
 
 	// Data
-	for (uint16_t i = 0; i < Len; i++)
+	if (data != NULL)
 	{
-		SPIC.DATA = data[i];
-		SPI_WAIT;
+		for (uint16_t i = 0; i < Len; i++)
+		{
+			dev->Spi->DATA = data[i];
+			ENC_SPI_WAIT(dev);
+		}
 	}
-	dummy = SPIC.DATA;	// to clear Interrupt Flag
-	SPI_CS_OFF;
+	dummy = dev->Spi->DATA;	// to clear Interrupt Flag
+	ENC_CS_OFF(dev);
 
 	// generate and write checksum to transmit buffer
-	int16_t checksum = GenerateUDPChecksum(UDPPseudoHeader, 20, BuffAddr + UDP_HEADER_LEN, Len);
-	ENC_WGPWRPT(chksumAddr);
-	SPI_CS_ON;
-	SPIC.DATA = WGPDATA;
-	SPI_WAIT;
-	SPIC.DATA = checksum>>8;
-	SPI_WAIT;
-	SPIC.DATA = checksum & 0xff;
-	SPI_WAIT;
-	dummy = SPIC.DATA;	// to clear Interrupt Flag
-	SPI_CS_OFF;
+	int16_t checksum = GenerateUDPChecksum(dev, UDPPseudoHeader, 20, BuffAddr + UDP_HEADER_LEN, Len);
+	ENC_WGPWRPT(dev, chksumAddr);
+	ENC_CS_ON(dev);
+	dev->Spi->DATA = WGPDATA;
+	ENC_SPI_WAIT(dev);
+	dev->Spi->DATA = checksum>>8;
+	ENC_SPI_WAIT(dev);
+	dev->Spi->DATA = checksum & 0xff;
+	ENC_SPI_WAIT(dev);
+	dummy = dev->Spi->DATA;	// to clear Interrupt Flag
+	ENC_CS_OFF(dev);
+}
 
 
+// Transmit frame already constructed in general purpose buffer. Waits for completion of ongoing transmission.
+// Parameters:
+//			BuffAddr	- start address of frame in general purpose buffer
+//			FrameLen	- total number of bytes in Tx buffer: Ethernet frame header (8) + IPv4 header (20) +
+//						  UDP header (8) + UDP data
+void ENC_TxFrame(ENC_Device *dev, uint16_t BuffAddr, uint16_t FrameLen)
+{
+	if (dev->Capture != NULL) dev->Capture(dev, BuffAddr, FrameLen, ENC_CAPTURE_TX);
+
 	// wait for completion of ongoing transmission
-	while (ENC_RCRU(ECON1) & ENC_ECON1_TXRTS_bm);
+	while (ENC_RCRU(dev, ECON1) & ENC_ECON1_TXRTS_bm);
 
-	ENC_SETTXRTS();		// start transmission
+	// start address (ETXST) and len => ETXLEN. Written only after previous transmission has completed.
+	ENC_WCRU(dev, ETXST, BuffAddr);
+	ENC_WCRU(dev, ETXLEN, FrameLen);
 
+	ENC_SETTXRTS(dev);		// start transmission
+	dev->Stats.TxFrames++;
 }
 
 
 // Resend the last sent UDP datagram
-void ENC_ReSendUDPFrame()
+void ENC_ReSendUDPFrame(ENC_Device *dev)
 {
+	if (dev->Capture != NULL) dev->Capture(dev, ENC_RCRU(dev, ETXST), ENC_RCRU(dev, ETXLEN), ENC_CAPTURE_TX);
+
 	// wait for completion of ongoing transmission
-	while (ENC_RCRU(ECON1) & ENC_ECON1_TXRTS_bm);
+	while (ENC_RCRU(dev, ECON1) & ENC_ECON1_TXRTS_bm);
+
+	ENC_SETTXRTS(dev);		// start transmission
+	dev->Stats.TxFrames++;
+}
+
+
+// Construct and transmit UDP frame, keeping it in the retransmission ring until acknowledged.
+// Each frame gets a 16-bit sequence number and its own slot in general purpose buffer (TX slot pool of
+// current SRAM layout, see ENC_SetMemLayout), so retransmission only repoints ETXST/ETXLEN
+// instead of streaming the whole frame over SPI again. Returns ENC_ERR_RING_FULL if all slots hold
+// unacknowledged frames, or ENC_ERR_TXPOOL_BUSY if the slot pool is used by transmit scheduler (nothing is
+// sent in that case).
+// Parameters are the same as for ENC_SendUDPFrame, except:
+//			Seq		- returns sequence number assigned to the frame
+int8_t ENC_TxRingSend(ENC_Device *dev, uint8_t *SourceIPAddr, uint8_t *DestIPAddr, uint8_t *DestMACAddr, uint16_t SourcePort, uint16_t DestPort, uint16_t Len, uint8_t *data, uint16_t *Seq)
+{
+	if (dev->TxPoolSched) return ENC_ERR_TXPOOL_BUSY;
+	if ((uint16_t)(dev->TxRingNext - dev->TxRingBase) >= dev->Layout.TxSlots) return ENC_ERR_RING_FULL;
+	if (UDP_HEADER_LEN + Len > dev->Layout.TxSlotSize) return ENC_ERR_LONG_MSG;
 
-	ENC_SETTXRTS();		// start transmission
+	uint8_t slot = dev->TxRingNext & (dev->Layout.TxSlots - 1);
+	uint16_t BuffAddr = dev->Layout.TxStart + slot * dev->Layout.TxSlotSize;
+
+	// slot may still be transmitting (retransmission of an already acknowledged frame)
+	if (dev->TxRingLastAddr == BuffAddr)
+	{
+		while (ENC_RCRU(dev, ECON1) & ENC_ECON1_TXRTS_bm);
+	}
+
+	ENC_SendUDPFrame(dev, SourceIPAddr, DestIPAddr, DestMACAddr, SourcePort, DestPort, BuffAddr, Len, data);
+
+	dev->TxRingLen[slot] = UDP_HEADER_LEN + Len;
+	dev->TxRingLastAddr = BuffAddr;
+	*Seq = dev->TxRingNext++;
+
+	return OK;
+}
+
+
+// Retransmit retained frame with sequence number Seq. Only ETXST and ETXLEN are rewritten.
+// Returns ENC_ERR_NOFRAME if frame was already acknowledged or never sent.
+int8_t ENC_TxRingReSend(ENC_Device *dev, uint16_t Seq)
+{
+	if ((uint16_t)(Seq - dev->TxRingBase) >= (uint16_t)(dev->TxRingNext - dev->TxRingBase)) return ENC_ERR_NOFRAME;
+
+	uint8_t slot = Seq & (dev->Layout.TxSlots - 1);
+	uint16_t BuffAddr = dev->Layout.TxStart + slot * dev->Layout.TxSlotSize;
+
+	if (dev->Capture != NULL) dev->Capture(dev, BuffAddr, dev->TxRingLen[slot], ENC_CAPTURE_TX);
+
+	// wait for completion of ongoing transmission
+	while (ENC_RCRU(dev, ECON1) & ENC_ECON1_TXRTS_bm);
+
+	ENC_WCRU(dev, ETXST, BuffAddr);
+	ENC_WCRU(dev, ETXLEN, dev->TxRingLen[slot]);
+	dev->TxRingLastAddr = BuffAddr;
+
+	ENC_SETTXRTS(dev);		// start transmission
+	dev->Stats.ReTxFrames++;
+
+	return OK;
+}
+
+
+// Acknowledge all frames up to and including Seq and retransmit every frame sent after it (in order).
+// Returns number of retransmitted frames.
+uint8_t ENC_TxRingReSendAfter(ENC_Device *dev, uint16_t Seq)
+{
+	uint8_t count = 0;
+
+	ENC_TxRingAck(dev, Seq);
+	for (uint16_t s = dev->TxRingBase; s != dev->TxRingNext; s++)
+	{
+		ENC_TxRingReSend(dev, s);
+		count++;
+	}
+
+	return count;
+}
+
+
+// Acknowledge all frames up to and including Seq. Their slots become available for new frames.
+// Sequence numbers outside the retained window are ignored.
+void ENC_TxRingAck(ENC_Device *dev, uint16_t Seq)
+{
+	if ((uint16_t)(Seq - dev->TxRingBase) < (uint16_t)(dev->TxRingNext - dev->TxRingBase))
+	{
+		dev->TxRingBase = Seq + 1;
+	}
 }
 
 
 // Read UDP frame from read buffer. Returns number of data bytes read or -1 if frame is not an UDP frame. Allocates
 // memory required to store the data part of UDP frame. Checksum is ignored.
+// Fragments of IPv4 datagram are not delivered - they are stored in reassembly arena and function returns ENC_FRAGMENT,
+// or ENC_REASSEMBLED when datagram is complete (addresses, ports and Len are set, Data is NULL and the data
+// should be accessed through ENC_ReasmGet).
 // Prior to calling this function it is necessary to check that frame is available, either by polling the PKTCNT
 // bits (ESTAT<7:0>) for a non-zero value, or putting ENC_RdUDPFrame in ISR(PORTC_INT0_vect) interrupt routine.
 // Function updates 'NextPacketPointer'.
@@ -440,68 +825,70 @@ void ENC_ReSendUDPFrame()
 //		DestAddr	- destination IP address (IP address allocates to ENC)
 //		SourcePort	- source port (0 if not used)
 //		DestPort	- destination port
-//		Data		- received data
+//		Data		- received data (not allocated if ENC_ERR_NOMEM is returned - the frame is then discarded)
 // Since 'data' array is dynamically allocated IT IS NECESSARY TO FREE IT WHEN NO LONGER NEEDED.
-int8_t ENC_RdUDPFrame(uint8_t *SourceAddr, uint8_t *DestAddr, uint16_t *SourcePort, uint16_t *DestPort, uint16_t *Len, uint8_t **Data)
+int8_t ENC_RdUDPFrame(ENC_Device *dev, uint8_t *SourceAddr, uint8_t *DestAddr, uint16_t *SourcePort, uint16_t *DestPort, uint16_t *Len, uint8_t **Data)
 {
 	uint8_t dummy;
 	uint8_t lo, hi;
 	int8_t errorCode = 0;
+	uint16_t PacketPointer = dev->NextPacketPointer;		// start of this packet in receive buffer
+	uint32_t spiBytes = dev->Stats.SpiBytes;
 
 	// wait for packet reception (PacKeTCouNT > 0) => check interrupt at PC.0
 	//while (!(ENC_RCRU(ESTAT) & ENC_ESTAT_PKTCNT_bm));
 
 	// NextPacketPointer => ERXRDPT (receive buffer read pointer)
-	ENC_WCRU(ERXRDPT, NextPacketPointer);
+	ENC_WCRU(dev, ERXRDPT, dev->NextPacketPointer);
 
-	SPI_CS_ON;
-	SPIC.DATA = RRXDATA;	// command for sequential reading from receive buffer
-	SPI_WAIT;
+	ENC_CS_ON(dev);
+	dev->Spi->DATA = RRXDATA;	// command for sequential reading from receive buffer
+	ENC_SPI_WAIT(dev);
 	// read address of the next packet and write to NextPacketPointer
 	// lo byte
-	SPIC.DATA = DUMMY;
-	SPI_WAIT;
-	lo = SPIC.DATA;
+	dev->Spi->DATA = DUMMY;
+	ENC_SPI_WAIT(dev);
+	lo = dev->Spi->DATA;
 	// hi byte
-	SPIC.DATA = DUMMY;
-	SPI_WAIT;
-	hi = SPIC.DATA;
-	NextPacketPointer = lo + ((uint16_t)hi<<8);
+	dev->Spi->DATA = DUMMY;
+	ENC_SPI_WAIT(dev);
+	hi = dev->Spi->DATA;
+	dev->NextPacketPointer = lo + ((uint16_t)hi<<8);
 
 	// read Receive Status Vector (6 bytes)
 	uint8_t RSV[6];
 	for(uint8_t i = 0; i < 6; i++)
 	{
-		SPIC.DATA = DUMMY;
-		SPI_WAIT;
-		RSV[i] = SPIC.DATA;
+		dev->Spi->DATA = DUMMY;
+		ENC_SPI_WAIT(dev);
+		RSV[i] = dev->Spi->DATA;
 	}
-	// int16_t count = ((uint16_t)(RSV[0])<<8) + RSV[1];	// total packet size
+	uint16_t count = RSV[0] + ((uint16_t)RSV[1]<<8);	// received byte count (Ethernet header, payload and CRC)
 
 	// Ethernet header
 	// discard destination and source MAC addresses
 	for (uint8_t i = 0; i < 12; i++)
 	{
-		SPIC.DATA = DUMMY;
-		SPI_WAIT;
-		dummy = SPIC.DATA;
+		dev->Spi->DATA = DUMMY;
+		ENC_SPI_WAIT(dev);
+		dummy = dev->Spi->DATA;
 	}
 	// Ethertype
-	SPIC.DATA = DUMMY;
-	SPI_WAIT;
-	hi = SPIC.DATA;
-	SPIC.DATA = DUMMY;
-	SPI_WAIT;
-	lo = SPIC.DATA;
+	dev->Spi->DATA = DUMMY;
+	ENC_SPI_WAIT(dev);
+	hi = dev->Spi->DATA;
+	dev->Spi->DATA = DUMMY;
+	ENC_SPI_WAIT(dev);
+	lo = dev->Spi->DATA;
 	if(hi==0x08 && lo==0)	// IPv4 frame ?
 	{
 		// Read IPv4 header
 		uint8_t IPv4Header[20];		// 20 bytes header - options, if present, will be ignored
 		for(uint8_t i = 0; i < 20; i++)
 		{
-			SPIC.DATA = DUMMY;
-			SPI_WAIT;
-			IPv4Header[i] = SPIC.DATA;
+			dev->Spi->DATA = DUMMY;
+			ENC_SPI_WAIT(dev);
+			IPv4Header[i] = dev->Spi->DATA;
 		}
 
 		uint8_t hlen = 4 * (IPv4Header[0] & 0x0f);	// header length in bytes
@@ -509,16 +896,18 @@ int8_t ENC_RdUDPFrame(uint8_t *SourceAddr, uint8_t *DestAddr, uint16_t *SourcePo
 		// skip options, if exist
 		for(uint8_t i = 20; i < hlen; i++)
 		{
-			SPIC.DATA = DUMMY;
-			SPI_WAIT;
-			dummy = SPIC.DATA;
+			dev->Spi->DATA = DUMMY;
+			ENC_SPI_WAIT(dev);
+			dummy = dev->Spi->DATA;
 		}
 
-		if (version == 4)	// IPv4
-		{
-			// total length
-			uint16_t totalLen = ((uint16_t)(IPv4Header[2])<<8) + IPv4Header[3];
+		// total length
+		uint16_t totalLen = ((uint16_t)(IPv4Header[2])<<8) + IPv4Header[3];
 
+		// packet must fit in received frame (Ethernet header 14, CRC 4) - otherwise stale bytes of
+		// receive buffer would be read as its payload
+		if (version == 4 && totalLen >= hlen && (uint32_t)totalLen + 18 <= count)	// IPv4
+		{
 			// Check higher level protocol
 			if (IPv4Header[9] == PROTOCOL_UDP)
 			{
@@ -535,26 +924,50 @@ int8_t ENC_RdUDPFrame(uint8_t *SourceAddr, uint8_t *DestAddr, uint16_t *SourcePo
 				DestAddr[2] = IPv4Header[18];
 				DestAddr[3] = IPv4Header[19];
 
-				uint8_t UDPHeader[8];
-				for(uint8_t i = 0; i < 8; i++)
+				// flags and fragment offset
+				uint16_t fragment = ((uint16_t)(IPv4Header[6])<<8) + IPv4Header[7];
+				if (fragment & (ENC_IPv4_MF_bm | ENC_IPv4_FRAGOFF_gm))
 				{
-					SPIC.DATA = DUMMY;
-					SPI_WAIT;
-					UDPHeader[i] = SPIC.DATA;
+					// Fragment - terminate sequential reading and let the DMA copy payload to reassembly arena.
+					// Payload starts after next packet pointer (2), RSV (6), Ethernet header (14) and IPv4 header.
+					ENC_CS_OFF(dev);
+					uint16_t payloadAddr = PacketPointer + 22 + hlen;
+					if (payloadAddr > ENC_SRAM_END) payloadAddr = payloadAddr - (ENC_SRAM_END + 1) + dev->Layout.RxStart;
+					errorCode = ENC_ReasmFragment(dev, IPv4Header, payloadAddr, SourcePort, DestPort, Len);
+					*Data = NULL;
 				}
-				*SourcePort = ((uint16_t)(UDPHeader[0])<<8) + UDPHeader[1];
-				*DestPort = ((uint16_t)(UDPHeader[2])<<8) + UDPHeader[3];
-				*Len = ((uint16_t)(UDPHeader[4])<<8) + UDPHeader[5] - 8;
-				// Checksum (ignored)
-
-				// Data - check size of receive buffer
-				*Data = malloc(*Len);
-				// receive data
-				for(uint16_t i = 0; i < *Len; i++)
+				else
 				{
-					SPIC.DATA = DUMMY;
-					SPI_WAIT;
-					Data[i] = SPIC.DATA;
+					uint8_t UDPHeader[8];
+					for(uint8_t i = 0; i < 8; i++)
+					{
+						dev->Spi->DATA = DUMMY;
+						ENC_SPI_WAIT(dev);
+						UDPHeader[i] = dev->Spi->DATA;
+					}
+					*SourcePort = ((uint16_t)(UDPHeader[0])<<8) + UDPHeader[1];
+					*DestPort = ((uint16_t)(UDPHeader[2])<<8) + UDPHeader[3];
+					uint16_t udpLen = ((uint16_t)(UDPHeader[4])<<8) + UDPHeader[5];
+					*Len = udpLen - 8;
+					// Checksum (ignored)
+
+					if (udpLen < 8 || udpLen > totalLen - hlen) errorCode = ENC_ERR_NOUDP;
+					else
+					{
+						// Data - frame is discarded if there is no memory for it
+						*Data = malloc(*Len);
+						if (*Data == NULL && *Len > 0) errorCode = ENC_ERR_NOMEM;
+						else
+						{
+							// receive data
+							for(uint16_t i = 0; i < *Len; i++)
+							{
+								dev->Spi->DATA = DUMMY;
+								ENC_SPI_WAIT(dev);
+								(*Data)[i] = dev->Spi->DATA;
+							}
+						}
+					}
 				}
 			}
 			else errorCode = ENC_ERR_NOUDP;
@@ -566,22 +979,407 @@ int8_t ENC_RdUDPFrame(uint8_t *SourceAddr, uint8_t *DestAddr, uint16_t *SourcePo
 	else errorCode = ENC_ERR_NOIPv4;
 
 
-	SPI_CS_OFF;		// terminate command for sequential reading from receive buffer
+	ENC_CS_OFF(dev);		// terminate command for sequential reading from receive buffer
+
+	// capture received frame (without CRC) before it is freed - frame starts after next packet pointer and RSV
+	if (dev->Capture != NULL)
+	{
+		uint16_t frameAddr = PacketPointer + 8;
+		if (frameAddr > ENC_SRAM_END) frameAddr = frameAddr - (ENC_SRAM_END + 1) + dev->Layout.RxStart;
+		dev->Capture(dev, frameAddr, RSV[0] + ((uint16_t)RSV[1]<<8) - 4, ENC_CAPTURE_RX);
+	}
 
 	//update RXTAIL pointer
 	int16_t newTail;
-	if (NextPacketPointer == 0) newTail = 0x5ffe;
-	else newTail = NextPacketPointer - 2;
-	ENC_WCRU(ERXTAIL, newTail);
+	if (dev->NextPacketPointer == dev->Layout.RxStart) newTail = ENC_SRAM_END - 1;
+	else newTail = dev->NextPacketPointer - 2;
+	ENC_WCRU(dev, ERXTAIL, newTail);
 
 	// Decrement PKTCNT by asserting ECON1.PKTDEC
 	//ENC_WCRU(ECON1, ENC_RCRU(ECON1) | ENC_ECON1_PKTDEC_bm);
-	ENC_BFSU(ECON1, ENC_ECON1_PKTDEC_bm);
+	ENC_BFSU(dev, ECON1, ENC_ECON1_PKTDEC_bm);
+
+	if (errorCode < 0) dev->Stats.RxErrors++;
+	else dev->Stats.RxFrames++;
+	dev->Stats.RxSpiBytes += dev->Stats.SpiBytes - spiBytes;
 
 	return errorCode;
 }
 
 
+// Service several controllers from interrupt routine. ENC interrupts of all controllers are disabled, then
+// received frames are read round-robin - one frame per controller in each pass - until no controller has
+// pending frames, so a controller receiving a burst can't starve the others. The controller that starts
+// the passes is rotated between calls; rotation state is kept in the group, so each interrupt routine
+// services its own group. Controllers held by ENC_RxHold are skipped. Handler is called for every frame
+// read with the result of ENC_RdUDPFrame; it is responsible for freeing received data.
+// Receive aborts (frames dropped by ENC) are counted in RxDrops. If the group has a clock, time from the
+// call to return of the handler is added to receive latency histogram for every frame.
+// Parameters:
+//			Group	- controllers sharing the interrupt
+//			Handler	- function called for every received frame
+void ENC_Service(ENC_DeviceGroup *Group, ENC_RxHandler Handler)
+{
+	uint8_t Count = Group->Count;
+	uint8_t SourceAddr[4], DestAddr[4];
+	uint16_t SourcePort, DestPort, Len;
+	uint8_t *Data;
+	uint8_t pending;
+	uint32_t start = Group->Clock ? Group->Clock() : 0;
+
+	for (uint8_t i = 0; i < Count; i++)
+	{
+		if (!Group->Devs[i]->RxHold) ENC_CLREIE(Group->Devs[i]);	// disable ENC interrupts (INT line goes inactive)
+	}
+
+	if (Group->First >= Count) Group->First = 0;
+	do
+	{
+		pending = 0;
+		for (uint8_t i = 0; i < Count; i++)
+		{
+			uint8_t n = Group->First + i;
+			if (n >= Count) n -= Count;
+			ENC_Device *dev = Group->Devs[n];
+
+			if (!dev->RxHold && (ENC_RCRU(dev, ESTAT) & ENC_ESTAT_PKTCNT_bm))
+			{
+				Data = NULL;
+				int8_t result = ENC_RdUDPFrame(dev, SourceAddr, DestAddr, &SourcePort, &DestPort, &Len, &Data);
+				Handler(dev, result, SourceAddr, DestAddr, SourcePort, DestPort, Len, Data);
+				if (Group->Clock) ENC_RecordLatency(dev, Group->Clock() - start);
+				pending = 1;
+			}
+		}
+	} while (pending);
+	Group->First++;
+
+	for (uint8_t i = 0; i < Count; i++)
+	{
+		ENC_Device *dev = Group->Devs[i];
+		if (dev->RxHold) continue;
+
+		// receive abort - frames were dropped by ENC since the last call
+		if (ENC_RCRU(dev, EIR) & ENC_EIR_RXABTIF_bm)
+		{
+			dev->Stats.RxDrops++;
+			ENC_BFCU(dev, EIR, ENC_EIR_RXABTIF_bm);
+		}
+		ENC_SETEIE(dev);	// enable ENC interrupts (if interrupt is pending INT line goes active again)
+	}
+}
+
+
+// Hold reception of dev in main loop: ENC interrupts of dev are disabled and ENC_Service skips it, so
+// main loop can use SPI and DMA of dev while interrupts of the MCU stay enabled. Received frames wait in
+// receive buffer until ENC_RxResume.
+void ENC_RxHold(ENC_Device *dev)
+{
+	dev->RxHold = 1;		// set first - interrupt routine can't start using dev after this
+	ENC_CLREIE(dev);
+}
+
+
+// Resume reception held by ENC_RxHold. Hold is cleared before ENC interrupts are enabled, so the INT edge
+// of frames received meanwhile is not ignored by ENC_Service.
+void ENC_RxResume(ENC_Device *dev)
+{
+	dev->RxHold = 0;
+	ENC_SETEIE(dev);
+}
+
+
+
+// Store IPv4 fragment in reassembly arena. Payload at PayloadAddr in receive buffer is copied by ENC DMA
+// to its offset in the arena, and received 8-byte blocks are marked in ReasmMap. When all blocks up to the
+// end of the last fragment are present, UDP header is read from the arena to return ports and data length.
+// Only one datagram is reassembled at a time - fragment of another datagram abandons the incomplete one.
+// Returns ENC_FRAGMENT, ENC_REASSEMBLED or error code.
+static int8_t ENC_ReasmFragment(ENC_Device *dev, uint8_t *IPv4Header, uint16_t PayloadAddr, uint16_t *SourcePort, uint16_t *DestPort, uint16_t *Len)
+{
+	uint8_t hlen = 4 * (IPv4Header[0] & 0x0f);
+	uint16_t totalLen = ((uint16_t)(IPv4Header[2])<<8) + IPv4Header[3];
+	uint16_t id = ((uint16_t)(IPv4Header[4])<<8) + IPv4Header[5];
+	uint16_t fragment = ((uint16_t)(IPv4Header[6])<<8) + IPv4Header[7];
+	uint16_t offset = (fragment & ENC_IPv4_FRAGOFF_gm) * 8;		// offset in bytes
+	uint16_t fragLen = totalLen - hlen;
+
+	if (dev->ReasmReady) return ENC_ERR_REASM_BUSY;
+
+	// fragment of a new datagram?
+	if (dev->ReasmTimer == 0 || dev->ReasmID != id || memcmp(dev->ReasmSrc, IPv4Header + 12, 4) != 0)
+	{
+		memcpy(dev->ReasmSrc, IPv4Header + 12, 4);
+		dev->ReasmID = id;
+		dev->ReasmTotal = 0;
+		memset(dev->ReasmMap, 0, sizeof(dev->ReasmMap));
+	}
+	dev->ReasmTimer = ENC_REASM_TIMEOUT;
+
+	if (totalLen < hlen || (uint32_t)offset + fragLen > dev->Layout.ReasmLen)
+	{
+		dev->ReasmTimer = 0;		// datagram doesn't fit in the arena - discard it
+		return ENC_ERR_LONG_MSG;
+	}
+
+	if (!(fragment & ENC_IPv4_MF_bm)) dev->ReasmTotal = offset + fragLen;	// last fragment
+
+	if (fragLen > 0)
+	{
+		// Copy payload to its place in the arena. DMA wraps the source pointer at the end of receive buffer.
+		ENC_WCRU(dev, EDMAST, PayloadAddr);
+		ENC_WCRU(dev, EDMADST, dev->Layout.ReasmStart + offset);
+		ENC_WCRU(dev, EDMALEN, fragLen);
+		ENC_DMACOPY(dev);
+
+		// mark received blocks while DMA is copying
+		for (uint16_t b = offset / 8; b < (offset + fragLen + 7) / 8; b++)
+		{
+			dev->ReasmMap[b >> 3] |= 1 << (b & 7);
+		}
+
+		// Wait for ENC DMA to finish (data must be copied before ERXTAIL frees the packet)
+		while (ENC_RCRU(dev, ECON1) & ENC_ECON1_DMAST_bm);
+	}
+
+	// check for holes
+	if (dev->ReasmTotal == 0) return ENC_FRAGMENT;
+	for (uint16_t b = 0; b < (dev->ReasmTotal + 7) / 8; b++)
+	{
+		if (!(dev->ReasmMap[b >> 3] & (1 << (b & 7)))) return ENC_FRAGMENT;
+	}
+
+	// datagram complete - UDP header is at the start of the arena
+	uint8_t UDPHeader[8];
+	ENC_RdGPBuff(dev, dev->Layout.ReasmStart, UDPHeader, 8);
+	uint16_t udpLen = ((uint16_t)(UDPHeader[4])<<8) + UDPHeader[5];
+	if (dev->ReasmTotal < 8 || udpLen < 8 || udpLen > dev->ReasmTotal)
+	{
+		dev->ReasmTimer = 0;
+		return ENC_ERR_NOUDP;
+	}
+	*SourcePort = ((uint16_t)(UDPHeader[0])<<8) + UDPHeader[1];
+	*DestPort = ((uint16_t)(UDPHeader[2])<<8) + UDPHeader[3];
+	*Len = udpLen - 8;
+	dev->ReasmDataLen = *Len;
+	dev->ReasmReady = 1;
+	dev->ReasmTimer = ENC_REASM_TIMEOUT;		// datagram is discarded if it isn't released in time
+
+	return ENC_REASSEMBLED;
+}
+
+
+// Get read handle of reassembled datagram. Data stays in ENC SRAM and could be read in parts
+// with ENC_RdGPBuff. No further fragments are accepted until ENC_ReasmRelease is called, or until
+// datagram times out (ENC_REASM_TIMEOUT calls of ENC_ReasmTick).
+// Returns ERR if there is no complete datagram.
+int8_t ENC_ReasmGet(ENC_Device *dev, ENC_SRAMBlock *Block)
+{
+	if (!dev->ReasmReady) return ERR;
+
+	Block->Addr = dev->Layout.ReasmStart + 8;		// skip UDP header
+	Block->Len = dev->ReasmDataLen;
+
+	return OK;
+}
+
+
+// Release reassembly arena after reassembled datagram has been processed
+void ENC_ReasmRelease(ENC_Device *dev)
+{
+	dev->ReasmReady = 0;
+	dev->ReasmTimer = 0;
+}
+
+
+// Age datagram held in arena. Should be called periodically (e.g. every 100 ms from timer interrupt);
+// incomplete datagram is discarded after ENC_REASM_TIMEOUT calls without receiving its fragment, and
+// complete datagram after ENC_REASM_TIMEOUT calls without ENC_ReasmRelease, so a handler that doesn't
+// collect reassembled datagrams can't block reassembly.
+void ENC_ReasmTick(ENC_Device *dev)
+{
+	if (dev->ReasmTimer > 0 && --dev->ReasmTimer == 0) dev->ReasmReady = 0;
+}
+
+
+// User-defined area ring buffer
+// User-defined area (EUDAST..EUDAND, see ENC_SetMemLayout) is used as byte ring buffer for application data,
+// e.g. to log samples at high rate and send them later. ENC wraps EUDARDPT/EUDAWRPT from EUDAND to EUDAST
+// during sequential access, so blocks crossing the end of the area are transferred in one SPI command.
+
+// Empty the ring
+void ENC_UDAReset(ENC_Device *dev)
+{
+	dev->UdaHead = 0;
+	dev->UdaTail = 0;
+	dev->UdaCount = 0;
+}
+
+
+// Number of bytes stored in the ring
+uint16_t ENC_UDAUsed(ENC_Device *dev)
+{
+	return dev->UdaCount;
+}
+
+
+// Number of free bytes in the ring
+uint16_t ENC_UDAFree(ENC_Device *dev)
+{
+	return dev->Layout.UdaLen - dev->UdaCount;
+}
+
+
+// Append Len bytes to the ring. Nothing is written and ENC_ERR_UDA_FULL is returned if there is no room for whole block.
+int8_t ENC_UDAWrite(ENC_Device *dev, uint8_t *Data, uint16_t Len)
+{
+	uint8_t dummy;
+
+	if (Len > ENC_UDAFree(dev)) return ENC_ERR_UDA_FULL;
+
+	ENC_WUDAWRPT(dev, dev->Layout.UdaStart + dev->UdaHead);
+
+	ENC_CS_ON(dev);
+	dev->Spi->DATA = WUDADATA;
+	ENC_SPI_WAIT(dev);
+	for (uint16_t i = 0; i < Len; i++)
+	{
+		dev->Spi->DATA = Data[i];
+		ENC_SPI_WAIT(dev);
+	}
+	dummy = dev->Spi->DATA;	// to clear Interrupt Flag
+	ENC_CS_OFF(dev);
+
+	dev->UdaHead += Len;
+	if (dev->UdaHead >= dev->Layout.UdaLen) dev->UdaHead -= dev->Layout.UdaLen;
+	dev->UdaCount += Len;
+
+	return OK;
+}
+
+
+// Read Len bytes starting Offset bytes after the oldest stored byte, without removing them from the ring
+int8_t ENC_UDAPeek(ENC_Device *dev, uint16_t Offset, uint8_t *Data, uint16_t Len)
+{
+	if ((uint32_t)Offset + Len > dev->UdaCount) return ENC_ERR_UDA_EMPTY;
+
+	uint16_t pos = dev->UdaTail + Offset;
+	if (pos >= dev->Layout.UdaLen) pos -= dev->Layout.UdaLen;
+	ENC_WUDARDPT(dev, dev->Layout.UdaStart + pos);
+
+	ENC_CS_ON(dev);
+	dev->Spi->DATA = RUDADATA;	// command for sequential reading from user-defined area
+	ENC_SPI_WAIT(dev);
+	for (uint16_t i = 0; i < Len; i++)
+	{
+		dev->Spi->DATA = DUMMY;
+		ENC_SPI_WAIT(dev);
+		Data[i] = dev->Spi->DATA;
+	}
+	ENC_CS_OFF(dev);
+
+	return OK;
+}
+
+
+// Remove Len oldest bytes from the ring
+int8_t ENC_UDADiscard(ENC_Device *dev, uint16_t Len)
+{
+	if (Len > dev->UdaCount) return ENC_ERR_UDA_EMPTY;
+
+	dev->UdaTail += Len;
+	if (dev->UdaTail >= dev->Layout.UdaLen) dev->UdaTail -= dev->Layout.UdaLen;
+	dev->UdaCount -= Len;
+
+	return OK;
+}
+
+
+// Read and remove Len oldest bytes from the ring
+int8_t ENC_UDARead(ENC_Device *dev, uint8_t *Data, uint16_t Len)
+{
+	int8_t errorCode = ENC_UDAPeek(dev, 0, Data, Len);
+
+	if (errorCode == OK) ENC_UDADiscard(dev, Len);
+
+	return errorCode;
+}
+
+
+// Append Len bytes from ENC SRAM (starting at Addr) to the ring. Data is copied by ENC DMA; source in receive
+// buffer wraps at the end of receive buffer. Nothing is copied and ENC_ERR_UDA_FULL is returned if there is
+// no room for whole block.
+int8_t ENC_UDACopy(ENC_Device *dev, uint16_t Addr, uint16_t Len)
+{
+	if (Len > ENC_UDAFree(dev)) return ENC_ERR_UDA_FULL;
+
+	// DMA doesn't wrap at EUDAND - block crossing the end of the area is copied in two parts
+	uint16_t first = dev->Layout.UdaLen - dev->UdaHead;
+	if (first > Len) first = Len;
+
+	if (first > 0)
+	{
+		ENC_WCRU(dev, EDMAST, Addr);
+		ENC_WCRU(dev, EDMADST, dev->Layout.UdaStart + dev->UdaHead);
+		ENC_WCRU(dev, EDMALEN, first);
+		ENC_DMACOPY(dev);
+		while (ENC_RCRU(dev, ECON1) & ENC_ECON1_DMAST_bm);
+	}
+	if (Len > first)
+	{
+		Addr += first;
+		if (Addr > ENC_SRAM_END) Addr = Addr - (ENC_SRAM_END + 1) + dev->Layout.RxStart;
+		ENC_WCRU(dev, EDMAST, Addr);
+		ENC_WCRU(dev, EDMADST, dev->Layout.UdaStart);
+		ENC_WCRU(dev, EDMALEN, Len - first);
+		ENC_DMACOPY(dev);
+		while (ENC_RCRU(dev, ECON1) & ENC_ECON1_DMAST_bm);
+	}
+
+	dev->UdaHead += Len;
+	if (dev->UdaHead >= dev->Layout.UdaLen) dev->UdaHead -= dev->Layout.UdaLen;
+	dev->UdaCount += Len;
+
+	return OK;
+}
+
+
+// Send Len oldest bytes from the ring as UDP datagram and remove them from the ring. Data is copied by ENC DMA
+// from user-defined area to BuffAddr + UDP_HEADER_LEN, so it never passes through MCU RAM.
+// Parameters are the same as for ENC_SendUDPFrame (Len should be at most 1472).
+int8_t ENC_UDASendUDPFrame(ENC_Device *dev, uint8_t *SourceIPAddr, uint8_t *DestIPAddr, uint8_t *DestMACAddr, uint16_t SourcePort, uint16_t DestPort, uint16_t BuffAddr, uint16_t Len)
+{
+	if (Len > dev->UdaCount) return ENC_ERR_UDA_EMPTY;
+	if (Len > 1472) return ENC_ERR_LONG_MSG;
+
+	// DMA doesn't wrap at EUDAND - block crossing the end of the area is copied in two parts
+	uint16_t first = dev->Layout.UdaLen - dev->UdaTail;
+	if (first > Len) first = Len;
+
+	if (first > 0)
+	{
+		ENC_WCRU(dev, EDMAST, dev->Layout.UdaStart + dev->UdaTail);
+		ENC_WCRU(dev, EDMADST, BuffAddr + UDP_HEADER_LEN);
+		ENC_WCRU(dev, EDMALEN, first);
+		ENC_DMACOPY(dev);
+		while (ENC_RCRU(dev, ECON1) & ENC_ECON1_DMAST_bm);
+	}
+	if (Len > first)
+	{
+		ENC_WCRU(dev, EDMAST, dev->Layout.UdaStart);
+		ENC_WCRU(dev, EDMADST, BuffAddr + UDP_HEADER_LEN + first);
+		ENC_WCRU(dev, EDMALEN, Len - first);
+		ENC_DMACOPY(dev);
+		while (ENC_RCRU(dev, ECON1) & ENC_ECON1_DMAST_bm);
+	}
+
+	ENC_UDADiscard(dev, Len);
+
+	ENC_SendUDPFrame(dev, SourceIPAddr, DestIPAddr, DestMACAddr, SourcePort, DestPort, BuffAddr, Len, NULL);
+
+	return OK;
+}
+
 
 // Calculate IPv4 Header checksum and update header
 // Used to send proper IPv4 packet
@@ -618,7 +1416,7 @@ void GenerateIPv4HeaderChecksum(uint8_t *Header)
 //			HLen			- pseudoheader length
 //			DataStartAddr	- start address of data in general purpose buffer
 //			DLen			- data length in bytes
-uint16_t GenerateUDPChecksum(uint8_t *Header, uint16_t HLen, uint16_t DataStartAddr, uint16_t DLen)
+uint16_t GenerateUDPChecksum(ENC_Device *dev, uint8_t *Header, uint16_t HLen, uint16_t DataStartAddr, uint16_t DLen)
 {
 	volatile uint32_t sum = 0;
 	uint8_t carry;
@@ -628,14 +1426,14 @@ uint16_t GenerateUDPChecksum(uint8_t *Header, uint16_t HLen, uint16_t DataStartA
 	{
 		// Initialize DMA calculation of data checksum:
 		// Set EDMAST to the start address
-		ENC_WCRU(EDMAST, DataStartAddr);
+		ENC_WCRU(dev, EDMAST, DataStartAddr);
 		// Set EDMALEN to the length of the input data
-		ENC_WCRU(EDMALEN, DLen);
+		ENC_WCRU(dev, EDMALEN, DLen);
 		// Clear DMACPY (ECON1<4>) to prevent a copy operation.
 		// Clear DMANOCS (ECON1<2>) to select a	checksum calculation.
 		// Clear DMACSSD (ECON1<3>) to use the default seed of 0000h.
 		// Set DMAST to initiate the operation
-		ENC_DMACKSUM();
+		ENC_DMACKSUM(dev);
 	}
 
 	// Calculate Header checksum. ENC simultaneously calculates data checksum.
@@ -654,10 +1452,10 @@ uint16_t GenerateUDPChecksum(uint8_t *Header, uint16_t HLen, uint16_t DataStartA
 	if (DLen > 0)
 	{
 		// Wait for ENC DMA to finish data checksum calculation
-		while (ENC_RCRU(ECON1) & ENC_ECON1_DMAST_bm);
+		while (ENC_RCRU(dev, ECON1) & ENC_ECON1_DMAST_bm);
 
 		// Read data checksum
-		dataSum = ENC_RCRU(EDMACS);	// LO and HI byte swapped !?
+		dataSum = ENC_RCRU(dev, EDMACS);	// LO and HI byte swapped !?
 		uint8_t lo = dataSum & 0x00ff;
 		uint8_t hi = dataSum >> 8;
 		dataSum = ~((lo<<8) + hi);
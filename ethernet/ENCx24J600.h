@@ -1,6 +1,8 @@
 #ifndef ENCX24J600_H_
 #define ENCX24J600_H_
 
+#include <avr/io.h>
+
 // masks
 #define ENC_ESTAT_CLKRDY_bm		0x1000
 
@@ -14,19 +16,25 @@
 
 #define ENC_ECON1_PKTDEC_bm		0x0100
 
+#define ENC_ESTAT_RXBUSY_bm		0x2000
+
 #define ENC_ERXFCON_BCEN_bm		0x0001
 
 #define ENC_ESTAT_PKTCNT_bm		0x00ff
 
+#define ENC_EIR_RXABTIF_bm		0x0002	// receive abort - frame dropped because receive buffer was full
+
 // ENCx24J600 SFR's addresses
 #define ERXST				0x04		// default 0x5340
 #define ERXTAIL				0x06		// default 0x5fee
 
 #define EDMAST				0x0a		// DMA start address
 #define EDMALEN				0x0c		// DMA length
+#define EDMADST				0x0e		// DMA destination address
 #define EDMACS				0x10		// checksum
 
 #define EUDAST				0x16		// user-defined area start address
+#define EUDAND				0x18		// user-defined area end address
 #define ERXFCON				0x34		// received filters control register
 
 #define MAAADR3				0x60		// MAC address
@@ -39,15 +47,22 @@
 #define ECON2				0x6e
 
 #define EIE					0x72		// Ethernet interrupt enable register
+#define EIR					0x1c		// Ethernet interrupt flag register
 
+#define EGPRDPT				0x86		// General purpose buffer read pointer
 #define EGPWRPT				0x88		// General purpose buffer write pointer
 #define ERXRDPT				0x8a		// Receive buffer read pointer
+#define EUDARDPT			0x8e		// User-defined area read pointer
+#define EUDAWRPT			0x90		// User-defined area write pointer
 
 #define ETXST				0x00		// Transmit data start pointer
 #define ETXLEN				0x02		// Transmit buffer length pointer
 
+#define RGPDATA				0x28		// OP-code for read from general purpose buffer data register
 #define WGPDATA				0x2a		// OP-code for write to general purpose buffer data register 
 #define RRXDATA				0x2c		// OP-code for read from receive buffer data register 
+#define RUDADATA			0x30		// OP-code for read from user-defined area data register
+#define WUDADATA			0x32		// OP-code for write to user-defined area data register
 
 
 
@@ -58,34 +73,241 @@
 #define ENC_ERR_NOIPv4		-2			// received frame doesn't contain IPv4 packet
 #define ENC_ERR_NOUDP		-3			// received frame doesn't contain UDP datagram
 #define ENC_ERR_LONG_MSG	-4			// received data longer than allocated space
+#define ENC_ERR_RING_FULL	-5			// all retransmission ring slots hold unacknowledged frames
+#define ENC_ERR_NOFRAME		-6			// requested frame is no longer retained in retransmission ring
+#define ENC_ERR_REASM_BUSY	-7			// reassembled datagram not yet released, fragment dropped
+#define ENC_ERR_LAYOUT		-8			// invalid SRAM layout (overlapping or out of range regions)
+#define ENC_ERR_UDA_FULL	-9			// not enough free space in user-defined area ring
+#define ENC_ERR_UDA_EMPTY	-10			// not enough data in user-defined area ring
+#define ENC_ERR_QUEUE_FULL	-11			// transmit scheduler flow queue is full, frame dropped
+#define ENC_ERR_NOMEM		-12			// no memory for received data
+#define ENC_ERR_TXPOOL_BUSY	-13			// TX slot pool is claimed by transmit scheduler (see TxSched.h)
+#define ENC_FRAGMENT		1			// received frame is a fragment, stored for reassembly
+#define ENC_REASSEMBLED		2			// received frame completed a fragmented datagram (see ENC_ReasmGet)
+
+#define ENC_CAPTURE_RX		0			// direction of captured frame
+#define ENC_CAPTURE_TX		1
 
 #define PROTOCOL_UDP		0x11
 
-// ENCx24J600 SPI instructions
-int8_t ENC_Init(void);
-void ENC_SETETHRST(void);				// Reset
-uint16_t ENC_RCRU(uint8_t);				// Read Control Register, Unbanked
-void ENC_WCRU(uint8_t, uint16_t);		// Write Control Register, Unbanked
-void ENC_BFSU(uint8_t, uint16_t);		// Bit Field Set, Unbanked
-void ENC_BFCU(uint8_t, uint16_t);		// Bit Field Clear, Unbanked
-void ENC_WGPWRPT(uint16_t);				// Write General Purpose Buffer Pointer
-void ENC_SETTXRTS(void);				// Transmint packet
-void ENC_CLREIE(void);					// disable interrupts
-void ENC_SETEIE(void);					// (re)enable interrupts
-void ENC_DMACKSUM(void);				// configure and start DMA checksum	
-
-
-void ENC_SendUDPFrame(uint8_t*, uint8_t*, uint8_t*, uint16_t, uint16_t, uint16_t, uint16_t, uint8_t*);
-void ENC_ReSendUDPFrame();
-int8_t ENC_RdUDPFrame(uint8_t*, uint8_t*, uint16_t*, uint16_t*, uint16_t*, uint8_t**);
-void GenerateIPv4HeaderChecksum(uint8_t*);
-uint16_t GenerateUDPChecksum(uint8_t*, uint16_t, uint16_t, uint16_t);
+#define ENC_IPv4_MF_bm			0x2000	// More Fragments flag
+#define ENC_IPv4_FRAGOFF_gm		0x1fff	// fragment offset (8-byte units)
 
+// Reassembled datagram held in ENC SRAM (zero-copy read handle)
+typedef struct
+{
+	uint16_t Addr;		// address of UDP data in general purpose buffer
+	uint16_t Len;		// length of UDP data
+} ENC_SRAMBlock;
+
+// Partitioning of 24 KB ENC SRAM. Receive ring always ends at the end of SRAM (ENC_SRAM_END),
+// other regions must lie below RxStart and must not overlap.
+typedef struct
+{
+	uint16_t RxStart;		// ERXST - receive ring occupies RxStart..ENC_SRAM_END (even address)
+	uint16_t TxStart;		// start of retransmission ring (TX slot pool)
+	uint8_t TxSlots;		// number of TX slots (power of 2, at most ENC_TXRING_SLOTS)
+	uint16_t TxSlotSize;	// bytes per TX slot
+	uint16_t ReasmStart;	// start of IPv4 reassembly arena
+	uint16_t ReasmLen;		// arena length (at most ENC_REASM_MAX_LEN)
+	uint16_t UdaStart;		// EUDAST - user-defined area
+	uint16_t UdaLen;		// user-defined area length, 0 disables user-defined area
+} ENC_MemLayout;
 
 #define UDP_HEADER_LEN			36		// length of transmitted UDP header
 
 #define RCV_DATA_LEN			512		// maximum length of received buffer
 
+// SRAM layout programmed by ENC_Init (compile-time partitioning). Every value could be overridden by
+// defining it in project settings; ENC_SetMemLayout changes the partitioning at run time.
+//	0x0000 - 0x07ff		ENC_SendUDPFrame buffer (BuffAddr 0)
+//	0x0800 - 0x37ff		TX slot pool, 8 x 1536 bytes (retransmission ring or transmit scheduler queues)
+//	0x3800 - 0x4fff		IPv4 reassembly arena
+//	0x5000 - 0x533f		user-defined area
+//	0x5340 - 0x5fff		receive ring
+#define ENC_SRAM_END			0x5fff	// last SRAM address
+#define ENC_RX_MIN_LEN			0x0600	// minimum receive ring - one maximum length frame with next packet pointer and RSV
+
+#ifndef ENC_RX_START
+#define ENC_RX_START			0x5340	// start of receive ring (ERXST)
+#endif
+
+// Retransmission ring - sent frames are kept in general purpose buffer until acknowledged
+#ifndef ENC_TXRING_START
+#define ENC_TXRING_START		0x0800	// start address of the ring in general purpose buffer (0x0000 left for ENC_SendUDPFrame)
+#endif
+#ifndef ENC_TXRING_SLOTS
+#define ENC_TXRING_SLOTS		8		// number of retained frames (power of 2)
+#endif
+#ifndef ENC_TXRING_SLOT_SIZE
+#define ENC_TXRING_SLOT_SIZE	0x0600	// bytes per slot (>= UDP_HEADER_LEN + 1472)
+#endif
+
+// IPv4 reassembly - fragments are stitched together by DMA copy in general purpose buffer
+#ifndef ENC_REASM_START
+#define ENC_REASM_START			0x3800	// start address of reassembly arena (after retransmission ring)
+#endif
+#ifndef ENC_REASM_MAX_LEN
+#define ENC_REASM_MAX_LEN		0x1800	// maximum IPv4 payload (UDP header + data) of reassembled datagram
+#endif
+#define ENC_REASM_TIMEOUT		30		// number of ENC_ReasmTick calls before incomplete or unreleased datagram is discarded
+
+// User-defined area
+#ifndef ENC_UDA_START
+#define ENC_UDA_START			0x5000	// EUDAST
+#endif
+#ifndef ENC_UDA_LEN
+#define ENC_UDA_LEN				0x0340	// user-defined area length (0 - disabled)
+#endif
+
+// compile-time layout check
+#if (ENC_RX_START & 1) || ENC_RX_START > ENC_SRAM_END + 1 - ENC_RX_MIN_LEN
+#error "ENC_RX_START must be even address leaving at least ENC_RX_MIN_LEN bytes for receive ring"
+#endif
+#if ENC_TXRING_SLOTS == 0 || (ENC_TXRING_SLOTS & (ENC_TXRING_SLOTS - 1))
+#error "ENC_TXRING_SLOTS must be power of 2"
+#endif
+#if ENC_TXRING_START + ENC_TXRING_SLOTS * ENC_TXRING_SLOT_SIZE > ENC_REASM_START
+#error "Retransmission ring overlaps reassembly arena"
+#endif
+#if ENC_REASM_START + ENC_REASM_MAX_LEN > ENC_UDA_START
+#error "Reassembly arena overlaps user-defined area"
+#endif
+#if ENC_UDA_START + ENC_UDA_LEN > ENC_RX_START
+#error "User-defined area overlaps receive ring"
+#endif
+
+
+#define ENC_LATENCY_BINS		16		// receive latency histogram: bin 0 < 2 us, bin i from 2^i us, last bin from 32.8 ms
+
+// Driver statistics (read with ENC_GetStats, counters are updated from interrupt routine)
+typedef struct
+{
+	uint16_t TxFrames;		// transmitted frames
+	uint16_t ReTxFrames;	// frames retransmitted from retransmission ring
+	uint16_t RxFrames;		// received frames (UDP datagrams and fragments)
+	uint16_t RxErrors;		// received frames rejected by ENC_RdUDPFrame
+	uint16_t RxDrops;		// receive aborts counted by ENC_Service - at least one frame dropped by ENC each
+	uint32_t SpiBytes;		// bytes transferred over SPI (may miss some if SPI is used from main loop and interrupt)
+	uint32_t RxSpiBytes;	// bytes transferred over SPI by ENC_RdUDPFrame, per frame: RxSpiBytes / (RxFrames + RxErrors)
+	uint16_t RxLatency[ENC_LATENCY_BINS];	// frames by time from ENC_Service call to return of handler (saturating)
+} ENC_Stats;
+
+// ENCx24J600 device handle - SPI connection and driver state of one controller
+typedef struct ENC_Device
+{
+	SPI_t *Spi;					// SPI peripheral
+	PORT_t *CsPort;				// port with CS pin
+	uint8_t CsPin_bm;			// CS pin bit mask
+	PORT_t *IntPort;			// port with INT line
+	uint8_t IntPin;				// INT pin number
+
+	int16_t NextPacketPointer;	// pointer to the next packet in receive buffer
+	volatile uint8_t RxHold;	// reception held by ENC_RxHold - skipped by ENC_Service
+	ENC_MemLayout Layout;		// SRAM partitioning
+
+	// retransmission ring
+	uint16_t TxRingBase;					// sequence number of the oldest unacknowledged frame
+	uint16_t TxRingNext;					// sequence number of the next frame to be sent
+	uint16_t TxRingLen[ENC_TXRING_SLOTS];	// ETXLEN of the frame in each slot
+	uint16_t TxRingLastAddr;				// ETXST of the last started transmission
+	uint8_t TxPoolSched;					// TX slot pool is claimed by transmit scheduler, ring can't be used
+
+	// IPv4 reassembly (single datagram at a time)
+	uint8_t ReasmSrc[4];					// source IP address of datagram being reassembled
+	uint16_t ReasmID;						// IPv4 identification of datagram being reassembled
+	uint16_t ReasmTotal;					// payload length, 0 until last fragment is received
+	uint16_t ReasmDataLen;					// UDP data length of complete datagram
+	uint8_t ReasmTimer;						// ticks until timeout, 0 if arena is free
+	uint8_t ReasmReady;						// complete datagram is held in arena
+	uint8_t ReasmMap[(ENC_REASM_MAX_LEN + 63) / 64];	// received 8-byte blocks (1 bit per block)
+
+	// user-defined area ring (offsets relative to EUDAST)
+	uint16_t UdaHead;						// write offset
+	uint16_t UdaTail;						// read offset
+	uint16_t UdaCount;						// number of stored bytes
+
+	ENC_Stats Stats;
+
+	// frame capture hook (see Capture.c): called with address and length of every received and
+	// transmitted frame in ENC SRAM, while frame is still in the buffer. NULL if capture is disabled.
+	void (*Capture)(struct ENC_Device*, uint16_t, uint16_t, uint8_t);
+	uint32_t (*CaptureClock)(void);			// time source in microseconds for record timestamps
+	uint8_t CaptureMAC[6];					// MAC address of controller (inserted by ENC into transmitted frames)
+	uint16_t CaptureDrops;					// frames not captured because user-defined area was full
+} ENC_Device;
+
+// Receive handler called by ENC_Service: device, result of ENC_RdUDPFrame, source and destination IP address,
+// source and destination port, data length and data (NULL if not allocated)
+typedef void (*ENC_RxHandler)(ENC_Device*, int8_t, uint8_t*, uint8_t*, uint16_t, uint16_t, uint16_t, uint8_t*);
+
+// Controllers serviced together by ENC_Service (e.g. sharing one interrupt line)
+typedef struct
+{
+	ENC_Device **Devs;			// array of controllers
+	uint8_t Count;				// number of controllers
+	uint8_t First;				// controller serviced first in the next call (rotated by ENC_Service)
+	uint32_t (*Clock)(void);	// time in microseconds for receive latency histogram, NULL if not measured
+} ENC_DeviceGroup;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// ENCx24J600 SPI instructions
+int8_t ENC_Init(ENC_Device*, SPI_t*, PORT_t*, uint8_t, PORT_t*, uint8_t);
+void ENC_SETETHRST(ENC_Device*);									// Reset
+uint16_t ENC_RCRU(ENC_Device*, uint8_t);							// Read Control Register, Unbanked
+void ENC_WCRU(ENC_Device*, uint8_t, uint16_t);						// Write Control Register, Unbanked
+void ENC_BFSU(ENC_Device*, uint8_t, uint16_t);						// Bit Field Set, Unbanked
+void ENC_BFCU(ENC_Device*, uint8_t, uint16_t);						// Bit Field Clear, Unbanked
+void ENC_WGPWRPT(ENC_Device*, uint16_t);							// Write General Purpose Buffer Pointer
+void ENC_SETTXRTS(ENC_Device*);										// Transmint packet
+void ENC_CLREIE(ENC_Device*);										// disable interrupts
+void ENC_SETEIE(ENC_Device*);										// (re)enable interrupts
+int8_t ENC_SetMemLayout(ENC_Device*, const ENC_MemLayout*);			// partition SRAM
+void ENC_GetMemLayout(ENC_Device*, ENC_MemLayout*);
+void ENC_GetStats(ENC_Device*, ENC_Stats*);							// copy of driver statistics
+uint32_t ENC_RxLatencyPercentile(ENC_Device*, uint8_t);				// receive latency percentile in microseconds
+void ENC_DMACKSUM(ENC_Device*);										// configure and start DMA checksum	
+void ENC_DMACOPY(ENC_Device*);										// configure and start DMA copy
+void ENC_WGPRDPT(ENC_Device*, uint16_t);							// Write General Purpose Buffer Read Pointer
+void ENC_RdGPBuff(ENC_Device*, uint16_t, uint8_t*, uint16_t);		// Read block from general purpose buffer
+void ENC_WUDARDPT(ENC_Device*, uint16_t);							// Write User-Defined Area Read Pointer
+void ENC_WUDAWRPT(ENC_Device*, uint16_t);							// Write User-Defined Area Write Pointer
+
+
+void ENC_SendUDPFrame(ENC_Device*, uint8_t*, uint8_t*, uint8_t*, uint16_t, uint16_t, uint16_t, uint16_t, uint8_t*);
+void ENC_WrUDPFrame(ENC_Device*, uint8_t*, uint8_t*, uint8_t*, uint16_t, uint16_t, uint16_t, uint16_t, uint8_t*);
+void ENC_TxFrame(ENC_Device*, uint16_t, uint16_t);
+void ENC_ReSendUDPFrame(ENC_Device*);
+int8_t ENC_TxRingSend(ENC_Device*, uint8_t*, uint8_t*, uint8_t*, uint16_t, uint16_t, uint16_t, uint8_t*, uint16_t*);
+int8_t ENC_TxRingReSend(ENC_Device*, uint16_t);
+uint8_t ENC_TxRingReSendAfter(ENC_Device*, uint16_t);
+void ENC_TxRingAck(ENC_Device*, uint16_t);
+int8_t ENC_RdUDPFrame(ENC_Device*, uint8_t*, uint8_t*, uint16_t*, uint16_t*, uint16_t*, uint8_t**);
+void ENC_Service(ENC_DeviceGroup*, ENC_RxHandler);
+void ENC_RxHold(ENC_Device*);
+void ENC_RxResume(ENC_Device*);
+int8_t ENC_ReasmGet(ENC_Device*, ENC_SRAMBlock*);
+void ENC_ReasmRelease(ENC_Device*);
+void ENC_ReasmTick(ENC_Device*);
+void ENC_UDAReset(ENC_Device*);
+uint16_t ENC_UDAUsed(ENC_Device*);
+uint16_t ENC_UDAFree(ENC_Device*);
+int8_t ENC_UDAWrite(ENC_Device*, uint8_t*, uint16_t);
+int8_t ENC_UDAPeek(ENC_Device*, uint16_t, uint8_t*, uint16_t);
+int8_t ENC_UDARead(ENC_Device*, uint8_t*, uint16_t);
+int8_t ENC_UDADiscard(ENC_Device*, uint16_t);
+int8_t ENC_UDACopy(ENC_Device*, uint16_t, uint16_t);
+int8_t ENC_UDASendUDPFrame(ENC_Device*, uint8_t*, uint8_t*, uint8_t*, uint16_t, uint16_t, uint16_t, uint16_t);
+void GenerateIPv4HeaderChecksum(uint8_t*);
+uint16_t GenerateUDPChecksum(ENC_Device*, uint8_t*, uint16_t, uint16_t, uint16_t);
+
+#ifdef __cplusplus
+}
+#endif
+
 
 
 #endif /* ENCX24J600_H_ */
\ No newline at end of file
@@ -0,0 +1,406 @@
+// ********************************************************************************
+// * ENCx24J600.hpp
+// *
+// * Header-only C++ driver for ENCx24J600, specialized at compile time.
+// * Transport (SPI backend), SRAM layout and protocol configuration are template
+// * parameters, so everything known at build time - local and peer addresses, ports,
+// * SPI port, buffer addresses and optional features - is folded into the code.
+// * Register addresses, op codes and error codes are shared with ENCx24J600.c.
+// * This is a separate, minimal driver for a single controller talking to a single peer:
+// * retransmission ring, fragment reassembly, user-defined area ring and capture of
+// * ENCx24J600.c are not provided. Requires C++11 (avr-g++ -std=gnu++11).
+// *
+// * Example (SPI on port D, CS on PD4):
+// *
+// *	typedef EncDriver<XmegaSpi<0x09c0, 0x0660, 0x10>,
+// *					  EncLayout<0x0000>,
+// *					  EncFeatures<EncIP<192,168,1,11>, EncIP<192,168,1,10>,
+// *								  EncMAC<0x00,0x23,0x7d,0x00,0x8a,0x08>, 11000, 11000> > Enc;
+// *	Enc::Init();
+// *	Enc::SendUDPFrame(data, len);
+// ********************************************************************************
+
+#ifndef ENCX24J600_HPP_
+#define ENCX24J600_HPP_
+
+#if !defined(__cplusplus) || __cplusplus < 201103L
+#error "ENCx24J600.hpp requires C++11 - compile with -std=gnu++11"
+#endif
+
+#include <avr/io.h>
+#include <util/delay.h>
+#include "ENCx24J600.h"
+
+
+// SPI backend for XMEGA SPI peripheral. SpiAddr and CsPortAddr are I/O addresses of SPI and
+// port modules (e.g. SPID = 0x09c0, PORTD = 0x0660), so every access compiles to lds/sts.
+// A backend should provide:
+//		Select(), Deselect()	- assert/deassert CS
+//		Transfer(byte)			- transmit byte and return received byte
+//		Wait<us>()				- busy wait
+template <uintptr_t SpiAddr, uintptr_t CsPortAddr, uint8_t CsPin_bm>
+struct XmegaSpi
+{
+	static SPI_t &Spi() { return *(SPI_t *)SpiAddr; }
+	static PORT_t &CsPort() { return *(PORT_t *)CsPortAddr; }
+
+	static void Select() { CsPort().OUTCLR = CsPin_bm; }
+	static void Deselect() { CsPort().OUTSET = CsPin_bm; }
+
+	static uint8_t Transfer(uint8_t data)
+	{
+		Spi().DATA = data;
+		while (!(Spi().STATUS & SPI_IF_bm));	// wait for assertion of IF (transmit/receive completed)
+		return Spi().DATA;						// reading DATA clears Interrupt Flag
+	}
+
+	template <uint16_t Us>
+	static void Wait() { _delay_us(Us); }
+};
+
+
+// SRAM layout: transmit buffer in general purpose buffer, start of receive buffer (ERXST) and
+// user-defined area (EUDAST, length 0 disables it). Defaults are the compile-time layout of ENCx24J600.h
+// and the same rules as in ENC_SetMemLayout are checked.
+template <uint16_t TxBuffAddr, uint16_t RxStartAddr = ENC_RX_START,
+		  uint16_t UdaStartAddr = ENC_UDA_START, uint16_t UdaLength = ENC_UDA_LEN>
+struct EncLayout
+{
+	static const uint16_t TxBuff = TxBuffAddr;
+	static const uint16_t RxStart = RxStartAddr;
+	static const uint16_t UdaStart = UdaStartAddr;
+	static const uint16_t UdaLen = UdaLength;
+
+	static_assert(!(RxStart & 1) && RxStart <= ENC_SRAM_END + 1 - ENC_RX_MIN_LEN,
+				  "RxStart must be even address leaving at least ENC_RX_MIN_LEN bytes for receive ring");
+	static_assert((uint32_t)TxBuff + UDP_HEADER_LEN + 1472 <= RxStart, "transmit buffer overlaps receive ring");
+	static_assert((uint32_t)UdaStart + UdaLen <= RxStart, "user-defined area overlaps receive ring");
+	static_assert(UdaLen == 0 || UdaStart >= (uint32_t)TxBuff + UDP_HEADER_LEN + 1472 || (uint32_t)UdaStart + UdaLen <= TxBuff,
+				  "user-defined area overlaps transmit buffer");
+};
+
+
+// IPv4 address
+template <uint8_t A, uint8_t B, uint8_t C, uint8_t D>
+struct EncIP
+{
+	static const uint8_t B0 = A, B1 = B, B2 = C, B3 = D;
+	static const uint16_t W0 = ((uint16_t)A << 8) + B;		// 16-bit words for checksum
+	static const uint16_t W1 = ((uint16_t)C << 8) + D;
+};
+
+// MAC address
+template <uint8_t A, uint8_t B, uint8_t C, uint8_t D, uint8_t E, uint8_t F>
+struct EncMAC
+{
+	static const uint8_t B0 = A, B1 = B, B2 = C, B3 = D, B4 = E, B5 = F;
+};
+
+
+// Protocol configuration and optional features
+//		LocalIP, PeerIP, PeerMAC	- EncIP/EncMAC addresses of this node and of its peer
+//		LocalPort, PeerPort			- UDP ports
+//		TxUdpChecksum				- calculate UDP checksum of transmitted datagrams (0 is sent otherwise)
+//		RxPeerOnly					- accept only datagrams sent from PeerIP to LocalPort
+template <class LocalIPAddr, class PeerIPAddr, class PeerMACAddr, uint16_t LocalPortNum, uint16_t PeerPortNum,
+		  bool TxUdpChecksumEn = true, bool RxPeerOnlyEn = false>
+struct EncFeatures
+{
+	typedef LocalIPAddr LocalIP;
+	typedef PeerIPAddr PeerIP;
+	typedef PeerMACAddr PeerMAC;
+	static const uint16_t LocalPort = LocalPortNum;
+	static const uint16_t PeerPort = PeerPortNum;
+	static const bool TxUdpChecksum = TxUdpChecksumEn;
+	static const bool RxPeerOnly = RxPeerOnlyEn;
+};
+
+
+template <class Spi, class Layout, class Features>
+class EncDriver
+{
+	typedef typename Features::LocalIP LocalIP;
+	typedef typename Features::PeerIP PeerIP;
+	typedef typename Features::PeerMAC PeerMAC;
+
+	// add carries to 16-bit one's complement sum
+	static constexpr uint32_t Fold(uint32_t sum) { return sum > 0xffff ? Fold((sum & 0xffff) + (sum >> 16)) : sum; }
+
+	// IPv4 header checksum of constant fields (version/IHL, TTL/protocol, addresses); total length is added at run time
+	static constexpr uint32_t IPv4PartialSum = Fold(0x4500UL + 0x8000 + PROTOCOL_UDP + LocalIP::W0 + LocalIP::W1 + PeerIP::W0 + PeerIP::W1);
+	// UDP pseudo header and header checksum of constant fields; length (twice) and data are added at run time
+	static constexpr uint32_t UDPPartialSum = Fold((uint32_t)PROTOCOL_UDP + LocalIP::W0 + LocalIP::W1 + PeerIP::W0 + PeerIP::W1 +
+												   Features::LocalPort + Features::PeerPort);
+
+	static int16_t NextPacketPointer;	// pointer to the next packet in receive buffer
+
+public:
+	// Read Control Register Unbanked
+	static uint16_t RCRU(uint8_t addr)
+	{
+		Spi::Select();
+		Spi::Transfer(0x20);	// op code
+		Spi::Transfer(addr);
+		uint8_t lo = Spi::Transfer(DUMMY);
+		uint8_t hi = Spi::Transfer(DUMMY);
+		Spi::Deselect();
+		return lo + ((uint16_t)hi << 8);
+	}
+
+	// Write Control Register Unbanked (op code 0x22), Bit Field Set (0x24) and Clear (0x26) Unbanked
+	template <uint8_t OpCode = 0x22>
+	static void WCRU(uint8_t addr, uint16_t data)
+	{
+		Spi::Select();
+		Spi::Transfer(OpCode);
+		Spi::Transfer(addr);
+		Spi::Transfer(data & 0xff);
+		Spi::Transfer(data >> 8);
+		Spi::Deselect();
+	}
+	static void BFSU(uint8_t addr, uint16_t mask) { WCRU<0x24>(addr, mask); }
+	static void BFCU(uint8_t addr, uint16_t mask) { WCRU<0x26>(addr, mask); }
+
+	// Single byte instruction (SETETHRST 0xca, DMACKSUM 0xd8, SETTXRTS 0xd4, CLREIE 0xee)
+	template <uint8_t OpCode>
+	static void Command()
+	{
+		Spi::Select();
+		Spi::Transfer(OpCode);
+		Spi::Deselect();
+	}
+
+	// Write General Purpose Buffer Write Pointer (EGPWRPT)
+	static void WGPWRPT(uint16_t BuffAddr)
+	{
+		Spi::Select();
+		Spi::Transfer(0x6c);	// op code
+		Spi::Transfer(BuffAddr & 0xff);
+		Spi::Transfer(BuffAddr >> 8);
+		Spi::Deselect();
+	}
+
+	static void SETEIE() { WCRU(EIE, 0x8040); }		// set INTIE and PKTIE (packet received interrupt enable)
+	static void CLREIE() { Command<0xee>(); }
+
+	// Initialize ENCx24J600 - same sequence as ENC_Init, SRAM programmed from Layout. Interrupt line should be
+	// configured by application.
+	static int8_t Init()
+	{
+		// Wait for ENC SPI interface to initialize
+		do
+		{
+			WCRU(EUDAST, 0x1234);
+		} while (RCRU(EUDAST) != 0x1234);
+
+		// Wait for stable clock
+		while (!(RCRU(ESTAT) & ENC_ESTAT_CLKRDY_bm));
+
+		// Reset
+		Command<0xca>();
+		Spi::template Wait<50>();
+
+		// Check that EUDAST returned to default value
+		if (RCRU(EUDAST) != 0x0000) return ERR;
+
+		// wait at least 256 us for PHY initialization
+		Spi::template Wait<500>();
+
+		// Enable Ethernet, LED stretching, automatic MAC Address transmission, transmit and receive logic
+		WCRU(ECON2, 0xe000);
+
+		// Receive buffer
+		WCRU(ERXST, Layout::RxStart);
+		WCRU(ERXTAIL, ENC_SRAM_END - 1);
+		NextPacketPointer = Layout::RxStart;
+
+		// User-defined area (placed outside SRAM to disable it) - as in ENC_SetMemLayout
+		if (Layout::UdaLen > 0)
+		{
+			WCRU(EUDAST, Layout::UdaStart);
+			WCRU(EUDAND, Layout::UdaStart + Layout::UdaLen - 1);
+		}
+		else
+		{
+			WCRU(EUDAST, ENC_SRAM_END + 1);
+			WCRU(EUDAND, ENC_SRAM_END + 2);
+		}
+
+		// Disable reception of broadcast frames, enable reception and ENC interrupts
+		BFCU(ERXFCON, ENC_ERXFCON_BCEN_bm);
+		BFSU(ECON1, ENC_ECON1_RXEN_bm);
+		SETEIE();
+
+		return OK;
+	}
+
+	// Construct and transmit UDP datagram to the peer (see ENC_SendUDPFrame). Header is streamed from
+	// compile-time constants, only lengths and checksums are calculated at run time.
+	static void SendUDPFrame(const uint8_t *data, uint16_t Len)
+	{
+		const uint16_t udpLen = Len + 8;
+		const uint16_t totalLen = udpLen + 20;
+		const uint16_t ipChecksum = ~Fold(IPv4PartialSum + totalLen);
+
+		// wait for completion of ongoing transmission - it may still be reading the single transmit buffer
+		while (RCRU(ECON1) & ENC_ECON1_TXRTS_bm);
+
+		WGPWRPT(Layout::TxBuff);
+
+		Spi::Select();
+		Spi::Transfer(WGPDATA);
+		// Ethernet header - destination MAC and Ethertype (source MAC is inserted by ENC)
+		Spi::Transfer(PeerMAC::B0); Spi::Transfer(PeerMAC::B1); Spi::Transfer(PeerMAC::B2);
+		Spi::Transfer(PeerMAC::B3); Spi::Transfer(PeerMAC::B4); Spi::Transfer(PeerMAC::B5);
+		Spi::Transfer(0x08); Spi::Transfer(0x00);
+		// IPv4 header
+		Spi::Transfer(0x45); Spi::Transfer(0x00);
+		Spi::Transfer(totalLen >> 8); Spi::Transfer(totalLen & 0xff);
+		Spi::Transfer(0x00); Spi::Transfer(0x00); Spi::Transfer(0x00); Spi::Transfer(0x00);
+		Spi::Transfer(0x80); Spi::Transfer(PROTOCOL_UDP);
+		Spi::Transfer(ipChecksum >> 8); Spi::Transfer(ipChecksum & 0xff);
+		Spi::Transfer(LocalIP::B0); Spi::Transfer(LocalIP::B1); Spi::Transfer(LocalIP::B2); Spi::Transfer(LocalIP::B3);
+		Spi::Transfer(PeerIP::B0); Spi::Transfer(PeerIP::B1); Spi::Transfer(PeerIP::B2); Spi::Transfer(PeerIP::B3);
+		// UDP header (checksum placeholder)
+		Spi::Transfer(Features::LocalPort >> 8); Spi::Transfer(Features::LocalPort & 0xff);
+		Spi::Transfer(Features::PeerPort >> 8); Spi::Transfer(Features::PeerPort & 0xff);
+		Spi::Transfer(udpLen >> 8); Spi::Transfer(udpLen & 0xff);
+		Spi::Transfer(0x00); Spi::Transfer(0x00);
+		// Data
+		for (uint16_t i = 0; i < Len; i++)
+		{
+			Spi::Transfer(data[i]);
+		}
+		Spi::Deselect();
+
+		if (Features::TxUdpChecksum)
+		{
+			uint16_t checksum = UDPChecksum(udpLen, Layout::TxBuff + UDP_HEADER_LEN, Len);
+			WGPWRPT(Layout::TxBuff + UDP_HEADER_LEN - 2);
+			Spi::Select();
+			Spi::Transfer(WGPDATA);
+			Spi::Transfer(checksum >> 8);
+			Spi::Transfer(checksum & 0xff);
+			Spi::Deselect();
+		}
+
+		WCRU(ETXST, Layout::TxBuff);
+		WCRU(ETXLEN, UDP_HEADER_LEN + Len);
+		Command<0xd4>();	// start transmission
+	}
+
+	// Read UDP frame from receive buffer into Data (at most MaxLen bytes). Returns OK or error code
+	// (see ENC_RdUDPFrame); fragments are not reassembled and are rejected with ENC_ERR_LONG_MSG.
+	// If RxPeerOnly feature is enabled, datagrams not sent by the peer to LocalPort are rejected with ERR.
+	// Parameters for returning values:
+	//		SourcePort	- source port
+	//		Len			- number of received data bytes
+	static int8_t RdUDPFrame(uint16_t &SourcePort, uint8_t *Data, uint16_t MaxLen, uint16_t &Len)
+	{
+		int8_t errorCode = OK;
+		uint8_t IPv4Header[20];
+		uint8_t UDPHeader[8];
+
+		WCRU(ERXRDPT, NextPacketPointer);
+
+		Spi::Select();
+		Spi::Transfer(RRXDATA);		// command for sequential reading from receive buffer
+		uint8_t lo = Spi::Transfer(DUMMY);
+		uint8_t hi = Spi::Transfer(DUMMY);
+		NextPacketPointer = lo + ((uint16_t)hi << 8);
+
+		// Receive Status Vector (6) - received byte count (Ethernet header, payload and CRC), rest is skipped
+		lo = Spi::Transfer(DUMMY);
+		hi = Spi::Transfer(DUMMY);
+		uint16_t count = lo + ((uint16_t)hi << 8);
+		// skip rest of Receive Status Vector (4), destination and source MAC (12)
+		for (uint8_t i = 0; i < 16; i++)
+		{
+			Spi::Transfer(DUMMY);
+		}
+		hi = Spi::Transfer(DUMMY);
+		lo = Spi::Transfer(DUMMY);
+
+		if (hi == 0x08 && lo == 0)		// IPv4 frame ?
+		{
+			for (uint8_t i = 0; i < 20; i++)
+			{
+				IPv4Header[i] = Spi::Transfer(DUMMY);
+			}
+			uint8_t hlen = 4 * (IPv4Header[0] & 0x0f);
+			for (uint8_t i = 20; i < hlen; i++)		// skip options
+			{
+				Spi::Transfer(DUMMY);
+			}
+			uint16_t totalLen = ((uint16_t)IPv4Header[2] << 8) + IPv4Header[3];
+
+			// packet must fit in received frame (Ethernet header 14, CRC 4)
+			if ((IPv4Header[0] >> 4) != 4 || totalLen < hlen || (uint32_t)totalLen + 18 > count) errorCode = ENC_ERR_NOIPv4;
+			else if (IPv4Header[9] != PROTOCOL_UDP) errorCode = ENC_ERR_NOUDP;
+			else if (((((uint16_t)IPv4Header[6] << 8) + IPv4Header[7]) & (ENC_IPv4_MF_bm | ENC_IPv4_FRAGOFF_gm))) errorCode = ENC_ERR_LONG_MSG;
+			else
+			{
+				for (uint8_t i = 0; i < 8; i++)
+				{
+					UDPHeader[i] = Spi::Transfer(DUMMY);
+				}
+				SourcePort = ((uint16_t)UDPHeader[0] << 8) + UDPHeader[1];
+				uint16_t udpLen = ((uint16_t)UDPHeader[4] << 8) + UDPHeader[5];
+				Len = udpLen - 8;
+
+				if (udpLen < 8 || udpLen > totalLen - hlen) errorCode = ENC_ERR_NOUDP;
+				else if (Features::RxPeerOnly &&
+					(IPv4Header[12] != PeerIP::B0 || IPv4Header[13] != PeerIP::B1 ||
+					 IPv4Header[14] != PeerIP::B2 || IPv4Header[15] != PeerIP::B3 ||
+					 UDPHeader[2] != (Features::LocalPort >> 8) || UDPHeader[3] != (Features::LocalPort & 0xff)))
+				{
+					errorCode = ERR;
+				}
+				else if (Len > MaxLen) errorCode = ENC_ERR_LONG_MSG;
+				else
+				{
+					for (uint16_t i = 0; i < Len; i++)
+					{
+						Data[i] = Spi::Transfer(DUMMY);
+					}
+				}
+			}
+		}
+		else errorCode = ENC_ERR_NOIPv4;
+
+		Spi::Deselect();	// terminate command for sequential reading from receive buffer
+
+		// update RXTAIL pointer and decrement PKTCNT
+		WCRU(ERXTAIL, NextPacketPointer == Layout::RxStart ? ENC_SRAM_END - 1 : NextPacketPointer - 2);
+		BFSU(ECON1, ENC_ECON1_PKTDEC_bm);
+
+		return errorCode;
+	}
+
+private:
+	// UDP checksum: constant part is precomputed, data checksum is calculated by ENC DMA (see GenerateUDPChecksum)
+	static uint16_t UDPChecksum(uint16_t udpLen, uint16_t DataStartAddr, uint16_t DLen)
+	{
+		uint32_t sum = UDPPartialSum + 2UL * udpLen;
+
+		if (DLen > 0)
+		{
+			WCRU(EDMAST, DataStartAddr);
+			WCRU(EDMALEN, DLen);
+			Command<0xd8>();		// DMACKSUM
+			while (RCRU(ECON1) & ENC_ECON1_DMAST_bm);
+
+			uint16_t dataSum = RCRU(EDMACS);	// LO and HI byte swapped
+			sum += (uint16_t)~(((dataSum & 0xff) << 8) + (dataSum >> 8));
+		}
+
+		uint16_t checksum = ~Fold(sum);
+		return checksum != 0 ? checksum : 0xffff;		// positive zero should be converted to negative zero
+	}
+};
+
+template <class Spi, class Layout, class Features>
+int16_t EncDriver<Spi, Layout, Features>::NextPacketPointer;
+
+
+#endif /* ENCX24J600_HPP_ */
@@ -0,0 +1,200 @@
+/*
+ * TxSched.c
+ *
+ * Rate-paced transmit scheduler for ENCx24J600.
+ * Every flow has a token bucket: ENC_SchedTick (called periodically, e.g. from timer interrupt)
+ * adds Rate tokens up to Burst, and a queued frame of n bytes is released only when the flow
+ * has n tokens. Control flows are not paced and are always released before paced flows.
+ * Paced flows with enough tokens are served round robin, one frame each per round, so
+ * periodic streams don't bunch up at the receiver.
+ */ 
+
+#include <avr/io.h>
+#include <util/atomic.h>
+#include "ENCx24J600.h"
+#include "TxSched.h"
+
+
+// Address of slot of flow queue in TX slot pool of current SRAM layout
+static uint16_t ENC_SchedSlotAddr(ENC_Sched *sched, uint8_t Flow, uint8_t Slot)
+{
+	ENC_MemLayout *layout = &sched->Dev->Layout;
+
+	return layout->TxStart + (Flow * SCHED_QUEUE_LEN + Slot) * layout->TxSlotSize;
+}
+
+
+// Initialize scheduler and claim TX slot pool of dev - frames retained in retransmission ring are dropped
+// and ENC_TxRingSend is refused until ENC_SchedStop. Returns ENC_ERR_LAYOUT if TX slot pool of dev can't
+// hold queue of a single flow (pool is not claimed in that case).
+// Parameters:
+//			Dev			- controller used for transmission
+int8_t ENC_SchedInit(ENC_Sched *sched, ENC_Device *Dev)
+{
+	sched->Dev = Dev;
+	sched->LastTxAddr = 0xffff;
+	sched->NumFlows = 0;
+	sched->NextFlow = 0;
+
+	if (Dev->Layout.TxSlots < SCHED_QUEUE_LEN) return ENC_ERR_LAYOUT;
+
+	Dev->TxPoolSched = 1;
+	Dev->TxRingBase = Dev->TxRingNext;
+
+	return OK;
+}
+
+
+// Stop scheduler and return TX slot pool to retransmission ring. Queued frames are dropped.
+void ENC_SchedStop(ENC_Sched *sched)
+{
+	// last released frame may still be transmitting from the pool
+	while (ENC_RCRU(sched->Dev, ECON1) & ENC_ECON1_TXRTS_bm);
+
+	sched->NumFlows = 0;
+	sched->Dev->TxPoolSched = 0;
+}
+
+
+// Add flow. Every flow takes SCHED_QUEUE_LEN slots of TX slot pool.
+// Returns flow number used by ENC_SchedSend, ERR if all flows are used or ENC_ERR_LAYOUT if there are
+// not enough free slots in TX slot pool.
+// Parameters:
+//			Priority	- SCHED_CONTROL or SCHED_PACED
+//			Rate		- bytes released per tick (Ethernet frame without CRC, i.e. UDP_HEADER_LEN + data length)
+//			Burst		- maximum number of bytes released at once, at least one frame. Bucket starts full.
+int8_t ENC_SchedAddFlow(ENC_Sched *sched, uint8_t Priority, uint16_t Rate, uint16_t Burst)
+{
+	if (sched->NumFlows >= SCHED_MAX_FLOWS) return ERR;
+	if ((sched->NumFlows + 1) * SCHED_QUEUE_LEN > sched->Dev->Layout.TxSlots) return ENC_ERR_LAYOUT;
+
+	ENC_Flow *flow = &sched->Flows[sched->NumFlows];
+	flow->Priority = Priority;
+	flow->Rate = Rate;
+	flow->Burst = Burst;
+	flow->Tokens = Burst;
+	flow->Head = 0;
+	flow->Count = 0;
+	flow->Drops = 0;
+
+	return sched->NumFlows++;
+}
+
+
+// Queue UDP datagram in flow Flow. Frame is constructed in the flow's slot in general purpose buffer
+// immediately, so no MCU RAM is needed for queued frames; it is transmitted by ENC_SchedRun.
+// Returns ERR if Flow was not added, ENC_ERR_QUEUE_FULL if flow queue is full, ENC_ERR_LONG_MSG if frame
+// doesn't fit in the slot or would never get enough tokens.
+// Other parameters are the same as for ENC_SendUDPFrame.
+int8_t ENC_SchedSend(ENC_Sched *sched, uint8_t Flow, uint8_t *SourceIPAddr, uint8_t *DestIPAddr, uint8_t *DestMACAddr, uint16_t SourcePort, uint16_t DestPort, uint16_t Len, uint8_t *data)
+{
+	if (Flow >= sched->NumFlows) return ERR;
+
+	ENC_Flow *flow = &sched->Flows[Flow];
+	uint16_t frameLen = UDP_HEADER_LEN + Len;
+
+	if (frameLen > sched->Dev->Layout.TxSlotSize) return ENC_ERR_LONG_MSG;
+	if (flow->Priority == SCHED_PACED && frameLen > flow->Burst) return ENC_ERR_LONG_MSG;
+	if (flow->Count >= SCHED_QUEUE_LEN)
+	{
+		flow->Drops++;
+		return ENC_ERR_QUEUE_FULL;
+	}
+
+	uint8_t slot = (flow->Head + flow->Count) & (SCHED_QUEUE_LEN - 1);
+	uint16_t BuffAddr = ENC_SchedSlotAddr(sched, Flow, slot);
+
+	// slot may still be transmitting
+	if (sched->LastTxAddr == BuffAddr)
+	{
+		while (ENC_RCRU(sched->Dev, ECON1) & ENC_ECON1_TXRTS_bm);
+	}
+
+	ENC_WrUDPFrame(sched->Dev, SourceIPAddr, DestIPAddr, DestMACAddr, SourcePort, DestPort, BuffAddr, Len, data);
+	flow->Len[slot] = frameLen;
+	flow->Count++;
+
+	return OK;
+}
+
+
+// Add tokens to every flow. Should be called periodically, e.g. from timer interrupt.
+void ENC_SchedTick(ENC_Sched *sched)
+{
+	for (uint8_t i = 0; i < sched->NumFlows; i++)
+	{
+		ENC_Flow *flow = &sched->Flows[i];
+		if ((uint32_t)flow->Tokens + flow->Rate > flow->Burst) flow->Tokens = flow->Burst;
+		else flow->Tokens += flow->Rate;
+	}
+}
+
+
+// Release oldest frame of the flow to TX engine
+static void ENC_SchedRelease(ENC_Sched *sched, uint8_t Flow)
+{
+	ENC_Flow *flow = &sched->Flows[Flow];
+	uint16_t BuffAddr = ENC_SchedSlotAddr(sched, Flow, flow->Head);
+
+	ENC_TxFrame(sched->Dev, BuffAddr, flow->Len[flow->Head]);
+	sched->LastTxAddr = BuffAddr;
+
+	flow->Head = (flow->Head + 1) & (SCHED_QUEUE_LEN - 1);
+	flow->Count--;
+}
+
+
+// Release queued frames which are due. All queued control frames are released first, then paced flows
+// are served round robin, one frame per flow in each round, while their frames are covered by tokens.
+// Should be called from main loop (after queuing frames and after ticks). Returns number of released frames.
+uint8_t ENC_SchedRun(ENC_Sched *sched)
+{
+	uint8_t released = 0;
+	uint8_t more;
+
+	do
+	{
+		more = 0;
+
+		// control flows - strict priority
+		for (uint8_t i = 0; i < sched->NumFlows; i++)
+		{
+			ENC_Flow *flow = &sched->Flows[i];
+			while (flow->Priority == SCHED_CONTROL && flow->Count > 0)
+			{
+				ENC_SchedRelease(sched, i);
+				released++;
+			}
+		}
+
+		// paced flows - one frame per flow, starting with flow after the one served first last time
+		for (uint8_t n = 0; n < sched->NumFlows; n++)
+		{
+			uint8_t i = sched->NextFlow + n;
+			if (i >= sched->NumFlows) i -= sched->NumFlows;
+			ENC_Flow *flow = &sched->Flows[i];
+
+			if (flow->Priority != SCHED_PACED || flow->Count == 0) continue;
+
+			uint8_t due = 0;
+			ATOMIC_BLOCK(ATOMIC_RESTORESTATE)	// tokens are also updated by ENC_SchedTick
+			{
+				if (flow->Tokens >= flow->Len[flow->Head])
+				{
+					flow->Tokens -= flow->Len[flow->Head];
+					due = 1;
+				}
+			}
+
+			if (due)
+			{
+				ENC_SchedRelease(sched, i);
+				released++;
+				more = 1;
+			}
+		}
+		if (++sched->NextFlow >= sched->NumFlows) sched->NextFlow = 0;
+	} while (more);
+
+	return released;
+}
@@ -0,0 +1,61 @@
+/*
+ * TxSched.h
+ *
+ * Rate-paced transmit scheduler - token bucket per flow, strict priority for control flows.
+ * Frames are constructed in ENC general purpose buffer when queued and released to the
+ * TX engine (ETXST/ETXLEN + TXRTS) when their flow has enough tokens.
+ * Queued frames are kept in the TX slot pool of the SRAM layout (see ENC_SetMemLayout), SCHED_QUEUE_LEN
+ * slots per flow. ENC_SchedInit claims the pool, so the retransmission ring (ENC_TxRingSend) is refused
+ * on the same controller until ENC_SchedStop.
+ * Scheduler should be initialized and flows added again after ENC_SetMemLayout.
+ */ 
+
+
+#ifndef TXSCHED_H_
+#define TXSCHED_H_
+
+#include "ENCx24J600.h"
+
+#define SCHED_QUEUE_LEN			4		// frames queued per flow (power of 2)
+#define SCHED_MAX_FLOWS			(ENC_TXRING_SLOTS / SCHED_QUEUE_LEN)	// maximum number of flows (queues fitting in TX slot pool)
+
+#if SCHED_MAX_FLOWS == 0
+#error "TX slot pool (ENC_TXRING_SLOTS) can't hold queue of a single flow"
+#endif
+
+#define SCHED_CONTROL			0		// flow priority: control traffic, not paced, released before paced flows
+#define SCHED_PACED				1		// flow priority: paced by token bucket
+
+// Flow state
+typedef struct
+{
+	uint8_t Priority;					// SCHED_CONTROL or SCHED_PACED
+	uint16_t Rate;						// tokens (bytes) added every tick
+	uint16_t Burst;						// bucket depth in bytes (largest burst released at once)
+	uint16_t Tokens;					// available tokens
+	uint8_t Head;						// oldest queued frame
+	uint8_t Count;						// number of queued frames
+	uint16_t Len[SCHED_QUEUE_LEN];		// frame length (ETXLEN) of queued frames
+	uint16_t Drops;						// frames dropped because queue was full
+} ENC_Flow;
+
+// Scheduler state - one per controller
+typedef struct
+{
+	ENC_Device *Dev;
+	uint16_t LastTxAddr;				// ETXST of the last released frame
+	uint8_t NumFlows;
+	uint8_t NextFlow;					// paced flow served first in the next round (round robin)
+	ENC_Flow Flows[SCHED_MAX_FLOWS];
+} ENC_Sched;
+
+int8_t ENC_SchedInit(ENC_Sched*, ENC_Device*);
+void ENC_SchedStop(ENC_Sched*);
+int8_t ENC_SchedAddFlow(ENC_Sched*, uint8_t, uint16_t, uint16_t);
+int8_t ENC_SchedSend(ENC_Sched*, uint8_t, uint8_t*, uint8_t*, uint8_t*, uint16_t, uint16_t, uint16_t, uint8_t*);
+void ENC_SchedTick(ENC_Sched*);
+uint8_t ENC_SchedRun(ENC_Sched*);
+
+
+
+#endif /* TXSCHED_H_ */
@@ -8,26 +8,29 @@
 
 #include <avr/io.h>
 #include <avr/interrupt.h>
+#include <stdlib.h>
 #include "main.h"
 #include "ENCx24J600.h"
 
-// Define UDP datagram fields
-uint8_t SourceAddr[4], DestAddr[4];
-uint16_t SourcePort, DestPort, Len;
-uint8_t *data;
-
 uint8_t PC_IPAddr[] = {192,168,1,10};
 uint8_t PC_MACAddr[] = {0x00,0x23,0x7d,0x00,0x8a,0x08};
 	
 	
 uint8_t uC_IPAddr[] = {192,168,1,11};
 
+// ENC controllers - a second controller on another SPI port is added to EncDevs
+ENC_Device Enc0;
+ENC_Device *EncDevs[] = {&Enc0};
+ENC_DeviceGroup EncGroup = {EncDevs, sizeof(EncDevs) / sizeof(EncDevs[0])};
+
 void Init();
-void SPID_INIT();
+void SPID_Init();
+void EchoFrame(ENC_Device*, int8_t, uint8_t*, uint8_t*, uint16_t, uint16_t, uint16_t, uint8_t*);
 
 int main(void)
 {
-	ENC_Init();
+	Init();
+	ENC_Init(&Enc0, &SPID, &PORTD, SPI_SS_bm, &PORTD, ENC_INT_PIN);
 	sei();
 	
 	uint8_t d[5] = {1,2,3,4,5};
@@ -60,7 +63,7 @@ void SPID_Init()
 {
 	// configure SS, MOSI and SCK as output.
 	PORTD.DIR = SPI_SS_bm | SPI_MOSI_bm | SPI_SCK_bm;
-	SPI_CS_OFF;
+	PORTD.OUTSET = SPI_SS_bm;		// deassert SS
 
 	// SPI_D - Master mode 00, Clk_per / 4 (8MHz)
 	SPID.CTRL= SPI_PRESCALER_DIV4_gc | SPI_ENABLE_bm | SPI_MASTER_bm | SPI_MODE_0_gc;
@@ -68,16 +71,22 @@ void SPID_Init()
 
 ISR(PORTD_INT0_vect)
 {
-	ENC_CLREIE();		// disable ENC interrupts (INT line goes inactive)
+	// read received frames of all controllers
+	ENC_Service(&EncGroup, EchoFrame);
+}
 
-	// read packet
-	if(ENC_RdUDPFrame(SourceAddr, DestAddr, &SourcePort, &DestPort, &Len, &data) == OK)
+// Called by ENC_Service for every received frame
+void EchoFrame(ENC_Device *dev, int8_t result, uint8_t *SourceAddr, uint8_t *DestAddr, uint16_t SourcePort, uint16_t DestPort, uint16_t Len, uint8_t *data)
+{
+	if(result == OK)
 	{	// if it is correct UDP frame, send it back
-		ENC_SendUDPFrame(uC_IPAddr, PC_IPAddr, PC_MACAddr, 11000, 11000, 0, Len, data);
-		free(data);		// free allocated memory
+		ENC_SendUDPFrame(dev, uC_IPAddr, PC_IPAddr, PC_MACAddr, 11000, 11000, 0, Len, data);
 	}
-	
-	ENC_SETEIE();		// enable ENC interrupts (if interrupt is pending INT line goes active again)
+	else if (result == ENC_REASSEMBLED)
+	{	// reassembled datagram is not echoed - release arena for the next one
+		ENC_ReasmRelease(dev);
+	}
+	free(data);		// free allocated memory
 }
 
 
@@ -14,9 +14,7 @@
 #define SPI_MISO_bm           0x40 // bit mask for the MISO pin
 #define SPI_SCK_bm            0x80 // bit mask for the SCK pin
 
-#define SPI_WAIT	while(!(SPIC.STATUS & SPI_IF_bm))	// wait for assertion of IF (transmit/receive completed)
-#define SPI_CS_ON	PORTD.OUTCLR = SPI_SS_bm			// assert SS
-#define SPI_CS_OFF	PORTD.OUTSET = SPI_SS_bm			// deassert SS
+#define ENC_INT_PIN           0    // ENC INT line on PORTD pin 0
 
 
 
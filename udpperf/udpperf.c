@@ -0,0 +1,292 @@
+/*
+ * udpperf.c
+ *
+ * UDP throughput/latency test firmware (iperf-style).
+ * As generator, sends test datagrams carrying sequence number and transmit timestamp with
+ * configurable payload length, rate, burst and count. As sink, measures received rate, loss,
+ * reordering and one-way jitter and reports them to the peer every PERF_REPORT_MS, together with driver
+ * statistics (SPI bytes per received frame, frames dropped by ENC, receive latency percentiles).
+ * Mode and generator parameters are set by control datagrams (see udpperf.h).
+ */
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <util/atomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "main.h"
+#include "ENCx24J600.h"
+#include "udpperf.h"
+
+uint8_t PC_IPAddr[] = {192,168,1,10};
+uint8_t PC_MACAddr[] = {0x00,0x23,0x7d,0x00,0x8a,0x08};
+
+uint8_t uC_IPAddr[] = {192,168,1,11};
+
+ENC_Device Enc0;
+ENC_Device *EncDevs[] = {&Enc0};
+ENC_DeviceGroup EncGroup = {EncDevs, 1};
+
+PerfConfig Config = {PERF_IDLE, PERF_PAYLOAD_LEN, PERF_RATE, PERF_BURST, PERF_COUNT};
+PerfStats Stats;
+
+volatile uint32_t Millis;		// incremented by TCC0 overflow every 1 ms
+
+uint8_t TxData[1472];
+uint16_t TxBuff[3];				// two test frame buffers (next frame is written while previous is transmitted), report buffer
+
+void Init();
+void SPID_Init();
+void TCC0_Init();
+uint32_t Micros();
+void PerfFrame(ENC_Device*, int8_t, uint8_t*, uint8_t*, uint16_t, uint16_t, uint16_t, uint8_t*);
+void SendReport(uint32_t);
+
+int main(void)
+{
+	ENC_MemLayout layout;
+	uint32_t seq = 0, sent = 0;
+	uint32_t nextBurst = 0, nextReport = 0;
+	uint8_t buff = 0;
+
+	Init();
+	if (ENC_Init(&Enc0, &SPID, &PORTD, SPI_SS_bm, &PORTD, ENC_INT_PIN) != OK)
+	{
+		while (1);		// controller not responding or SRAM layout rejected
+	}
+
+	// received frames are polled in main loop, so SPI is never used from interrupt
+	PORTD.INTCTRL &= ~PORT_INT0LVL_gm;
+	EncGroup.Clock = Micros;		// receive latency histogram
+
+	// TX ring is not used - its first three slots serve as transmit buffers
+	ENC_GetMemLayout(&Enc0, &layout);
+	TxBuff[0] = layout.TxStart;
+	TxBuff[1] = layout.TxStart + layout.TxSlotSize;
+	TxBuff[2] = layout.TxStart + 2 * layout.TxSlotSize;
+
+	TCC0_Init();
+	sei();
+
+	while (1)
+	{
+		// receive (ENC INT line is active low)
+		if (!(PORTD.IN & (1 << ENC_INT_PIN)))
+		{
+			ENC_Service(&EncGroup, PerfFrame);
+		}
+
+		uint32_t now = Micros();
+
+		if (Config.Mode == PERF_GEN)
+		{
+			if (Config.Count != 0 && sent >= Config.Count)
+			{
+				SendReport(sent);
+				Config.Mode = PERF_IDLE;
+			}
+			else if (Config.Rate == 0 || (int32_t)(now - nextBurst) >= 0)
+			{
+				for (uint8_t i = 0; i < Config.Burst && (Config.Count == 0 || sent < Config.Count); i++)
+				{
+					now = Micros();
+					TxData[0] = seq >> 24; TxData[1] = seq >> 16; TxData[2] = seq >> 8; TxData[3] = seq;
+					TxData[4] = now >> 24; TxData[5] = now >> 16; TxData[6] = now >> 8; TxData[7] = now;
+					ENC_SendUDPFrame(&Enc0, uC_IPAddr, PC_IPAddr, PC_MACAddr, PERF_DATA_PORT, PERF_DATA_PORT, TxBuff[buff], Config.PayloadLen, TxData);
+					buff ^= 1;
+					seq++;
+					sent++;
+				}
+				if (Config.Rate != 0) nextBurst += 1000000UL * Config.Burst / Config.Rate;
+			}
+		}
+		else
+		{
+			// keep pacing reference current while generator is stopped
+			nextBurst = now;
+			seq = 0;
+			sent = 0;
+		}
+
+		if (Config.Mode == PERF_SINK && (int32_t)(now - nextReport) >= 0)
+		{
+			SendReport(0);
+			nextReport = now + PERF_REPORT_MS * 1000UL;
+		}
+	}
+}
+
+
+// Called by ENC_Service for every received frame
+void PerfFrame(ENC_Device *dev, int8_t result, uint8_t *SourceAddr, uint8_t *DestAddr, uint16_t SourcePort, uint16_t DestPort, uint16_t Len, uint8_t *data)
+{
+	uint32_t arrival = Micros();
+
+	if (result != OK)
+	{
+		// test traffic is not fragmented - release arena for the next reassembled datagram
+		if (result == ENC_REASSEMBLED) ENC_ReasmRelease(dev);
+		free(data);
+		return;
+	}
+
+	if (DestPort == PERF_CTRL_PORT && Len >= 1)
+	{
+		switch (data[0])
+		{
+			case 'G':
+				if (Len >= 10)
+				{
+					Config.PayloadLen = ((uint16_t)data[1] << 8) + data[2];
+					Config.Rate = ((uint16_t)data[3] << 8) + data[4];
+					Config.Burst = data[5] ? data[5] : 1;
+					Config.Count = ((uint32_t)data[6] << 24) + ((uint32_t)data[7] << 16) + ((uint16_t)data[8] << 8) + data[9];
+					if (Config.PayloadLen < 8) Config.PayloadLen = 8;
+					if (Config.PayloadLen > sizeof(TxData)) Config.PayloadLen = sizeof(TxData);
+				}
+				Config.Mode = PERF_GEN;
+				break;
+			case 'S':
+				memset(&Stats, 0, sizeof(Stats));
+				memset(&dev->Stats, 0, sizeof(dev->Stats));	// frames are polled, so interrupt routine can't update it
+				Config.Mode = PERF_SINK;
+				break;
+			case 'X':
+				Config.Mode = PERF_IDLE;
+				break;
+		}
+	}
+	else if (DestPort == PERF_DATA_PORT && Config.Mode == PERF_SINK && Len >= 8)
+	{
+		uint32_t seq = ((uint32_t)data[0] << 24) + ((uint32_t)data[1] << 16) + ((uint16_t)data[2] << 8) + data[3];
+		uint32_t ts = ((uint32_t)data[4] << 24) + ((uint32_t)data[5] << 16) + ((uint16_t)data[6] << 8) + data[7];
+
+		// interarrival jitter (RFC 3550): J += (|D| - J) / 16, kept scaled by 16.
+		// Clocks don't have to be synchronized - only differences of transit times are used.
+		int32_t transit = arrival - ts;
+		if (Stats.Frames > 0)
+		{
+			int32_t d = transit - Stats.LastTransit;
+			if (d < 0) d = -d;
+			Stats.Jitter += d - ((Stats.Jitter + 8) >> 4);
+		}
+		Stats.LastTransit = transit;
+
+		if (Stats.Frames > 0 && seq < Stats.MaxSeq) Stats.Reordered++;
+		else Stats.MaxSeq = seq;
+		Stats.Frames++;
+		Stats.Bytes += Len;
+	}
+
+	free(data);
+}
+
+
+// Send text report to the peer. Sink: received frames, rate (frames/s and kbit/s of UDP data over last
+// interval), lost and reordered frames and jitter, then driver statistics since start of sink: SPI bytes
+// per received frame, frames dropped by ENC (receive aborts) and 50th/99th percentile of receive latency
+// (upper bound of histogram bin). Generator: number of sent frames.
+void SendReport(uint32_t sent)
+{
+	static uint32_t lastFrames, lastBytes, lastTime;
+	char report[224];
+	int len;
+	uint32_t now = Micros();
+
+	if (Config.Mode == PERF_GEN)
+	{
+		len = snprintf(report, sizeof(report), "gen sent=%lu len=%u\n", sent, Config.PayloadLen);
+	}
+	else
+	{
+		PerfStats s;
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+		{
+			s = Stats;
+		}
+		uint32_t ms = (now - lastTime) / 1000;
+		if (ms == 0) ms = 1;
+		uint32_t expected = s.Frames > 0 ? s.MaxSeq + 1 : 0;
+		len = snprintf(report, sizeof(report), "sink rx=%lu pps=%lu kbps=%lu lost=%lu reord=%lu jitter_us=%lu\n",
+					   s.Frames, (s.Frames - lastFrames) * 1000 / ms, (s.Bytes - lastBytes) * 8 / ms,
+					   expected > s.Frames ? expected - s.Frames : 0, s.Reordered, s.Jitter >> 4);
+		lastFrames = s.Frames;
+		lastBytes = s.Bytes;
+
+		ENC_Stats es;
+		ENC_GetStats(&Enc0, &es);
+		uint16_t rx = es.RxFrames + es.RxErrors;
+		len += snprintf(report + len, sizeof(report) - len, "enc spi_per_rx=%lu rx_drops=%u lat50_us=%lu lat99_us=%lu\n",
+						rx ? es.RxSpiBytes / rx : 0, es.RxDrops, ENC_RxLatencyPercentile(&Enc0, 50), ENC_RxLatencyPercentile(&Enc0, 99));
+	}
+	lastTime = now;
+
+	ENC_SendUDPFrame(&Enc0, uC_IPAddr, PC_IPAddr, PC_MACAddr, PERF_CTRL_PORT, PERF_CTRL_PORT, TxBuff[2], len, (uint8_t*)report);
+}
+
+
+// Time in microseconds (wraps after ~71 minutes)
+uint32_t Micros()
+{
+	uint32_t ms;
+	uint16_t cnt;
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		ms = Millis;
+		cnt = TCC0.CNT;
+		if (TCC0.INTFLAGS & TC0_OVFIF_bm)		// overflow not yet serviced
+		{
+			ms++;
+			cnt = TCC0.CNT;
+		}
+	}
+
+	return ms * 1000 + cnt * 2;
+}
+
+
+void Init()
+{
+	OSC.XOSCCTRL = OSC_FRQRANGE_12TO16_gc |                   // Select frequency range
+	OSC_XOSCSEL_XTAL_16KCLK_gc;                // Select start-up time
+	OSC.CTRL |= OSC_XOSCEN_bm;                                // Enable oscillator
+	while ( ! (OSC.STATUS & OSC_XOSCRDY_bm) );                // Wait for oscillator is ready
+
+	OSC.PLLCTRL = OSC_PLLSRC_XOSC_gc | (OSC_PLLFAC_gm & 2);   // Select PLL source and multipl. factor
+	OSC.CTRL |= OSC_PLLEN_bm;                                 // Enable PLL
+	while ( ! (OSC.STATUS & OSC_PLLRDY_bm) );                 // Wait for PLL is ready
+
+	CCP = CCP_IOREG_gc;                                       // Security signature to modify clock
+	CLK.CTRL = CLK_SCLKSEL_PLL_gc;                            // Select system clock source
+	OSC.CTRL &= ~OSC_RC2MEN_bm;                               // Turn off 2MHz internal oscillator
+	OSC.CTRL &= ~OSC_RC32MEN_bm;                              // Turn off 32MHz internal oscillator
+
+	SPID_Init();
+}
+
+void SPID_Init()
+{
+	// configure SS, MOSI and SCK as output.
+	PORTD.DIR = SPI_SS_bm | SPI_MOSI_bm | SPI_SCK_bm;
+	PORTD.OUTSET = SPI_SS_bm;		// deassert SS
+
+	// SPI_D - Master mode 00, Clk_per / 4 (8MHz)
+	SPID.CTRL= SPI_PRESCALER_DIV4_gc | SPI_ENABLE_bm | SPI_MASTER_bm | SPI_MODE_0_gc;
+}
+
+void TCC0_Init()
+{
+	// TCC0 - Clk_per / 64 (500 kHz, 2 us per count), overflow every 1 ms
+	TCC0.PER = 499;
+	TCC0.INTCTRLA = TC_OVFINTLVL_LO_gc;
+	TCC0.CTRLA = TC_CLKSEL_DIV64_gc;
+
+	PMIC.CTRL |= PMIC_LOLVLEN_bm;
+}
+
+ISR(TCC0_OVF_vect)
+{
+	Millis++;
+}
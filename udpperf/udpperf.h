@@ -0,0 +1,56 @@
+/*
+ * udpperf.h
+ *
+ * UDP throughput/latency test firmware - default configuration and control protocol.
+ */ 
+
+
+#ifndef UDPPERF_H_
+#define UDPPERF_H_
+
+#define PERF_CTRL_PORT			5001	// control datagrams and reports
+#define PERF_DATA_PORT			5002	// test traffic
+
+#define PERF_REPORT_MS			1000	// sink report interval
+
+// default generator configuration (used until a control datagram is received)
+#define PERF_PAYLOAD_LEN		1472	// UDP data length (8..1472)
+#define PERF_RATE				1000	// frames per second, 0 - as fast as possible
+#define PERF_BURST				1		// frames sent back-to-back every 1/(RATE/BURST) s
+#define PERF_COUNT				0		// frames to send, 0 - unlimited
+
+// modes
+#define PERF_IDLE				0
+#define PERF_GEN				1		// traffic generator
+#define PERF_SINK				2		// traffic sink
+
+// Control datagram sent to PERF_CTRL_PORT (multi-byte fields big-endian):
+//		'G' PayloadLen(2) Rate(2) Burst(1) Count(4)	- start generator
+//		'S'											- start sink (statistics are cleared)
+//		'X'											- stop
+// Test datagram data: sequence number (4), transmit timestamp in us (4), padding.
+// Reports are sent as text to the peer's PERF_CTRL_PORT.
+
+typedef struct
+{
+	uint8_t Mode;
+	uint16_t PayloadLen;
+	uint16_t Rate;
+	uint8_t Burst;
+	uint32_t Count;
+} PerfConfig;
+
+// Sink statistics
+typedef struct
+{
+	uint32_t Frames;			// received test frames
+	uint32_t Bytes;				// received UDP data bytes
+	uint32_t MaxSeq;			// highest received sequence number
+	uint32_t Reordered;			// frames received after a frame with higher sequence number
+	int32_t LastTransit;		// arrival - transmit timestamp of previous frame (us)
+	uint32_t Jitter;			// interarrival jitter (RFC 3550) in 1/16 us
+} PerfStats;
+
+
+
+#endif /* UDPPERF_H_ */